@@ -1,9 +1,134 @@
+// This file is compiled once per instruction set with -DTWOCATS_ISA=<name>, so give each
+// copy of the Blake2b library its own names.
+#define blake2b_init_param TWOCATS_ISA_NAME(blake2b_init_param)
+#define blake2b_init_key TWOCATS_ISA_NAME(blake2b_init_key)
+#define blake2b_init TWOCATS_ISA_NAME(blake2b_init)
+#define blake2b_update TWOCATS_ISA_NAME(blake2b_update)
+#define blake2b_final TWOCATS_ISA_NAME(blake2b_final)
+#define blake2b TWOCATS_ISA_NAME(blake2b)
+
 #include "twocats-internal.h"
 
-#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(TWOCATS_NO_SIMD)
+#include "../blake2-ref/blake2b-ref.c"
+#else
 #include "../blake2-sse/blake2b.c"
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#if defined(__AVX512VL__)
+#define BATCH_ROTR(x, n) _mm256_ror_epi64(x, n)
 #else
-#include "../blake2-ref/blake2b-ref.c"
+#define BATCH_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+#endif
+
+// The Blake2b G function on 4 messages at once, one in each 64-bit lane.
+#define BATCH_G(a, b, c, d, x, y) \
+    do { \
+        a = _mm256_add_epi64(_mm256_add_epi64(a, b), x); \
+        d = BATCH_ROTR(_mm256_xor_si256(d, a), 32); \
+        c = _mm256_add_epi64(c, d); \
+        b = BATCH_ROTR(_mm256_xor_si256(b, c), 24); \
+        a = _mm256_add_epi64(_mm256_add_epi64(a, b), y); \
+        d = BATCH_ROTR(_mm256_xor_si256(d, a), 16); \
+        c = _mm256_add_epi64(c, d); \
+        b = BATCH_ROTR(_mm256_xor_si256(b, c), 63); \
+    } while(0)
+
+// Transpose 4 rows of 4 uint64_t's.
+static inline void transpose4x4(__m256i r[4]) {
+    __m256i t0 = _mm256_unpacklo_epi64(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi64(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi64(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi64(r[2], r[3]);
+    r[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+    r[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+    r[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+    r[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+// Do what H->HashState does for 4 Blake2b states at once, hashing values[i] into
+// states[i].  The 68 byte message fits in one Blake2b block, so we run the 4
+// compressions together.
+static void hashStates4(uint32_t *states[4], const uint32_t values[4]) {
+    __m256i m[16];
+    for(uint32_t i = 0; i < 4; i++) {
+        m[i] = _mm256_loadu_si256((__m256i *)states[i]);
+        m[i + 4] = _mm256_loadu_si256((__m256i *)(states[i] + 8));
+    }
+    transpose4x4(m);
+    transpose4x4(m + 4);
+    m[8] = _mm256_set_epi64x(values[3], values[2], values[1], values[0]);
+    for(uint32_t i = 9; i < 16; i++) {
+        m[i] = _mm256_setzero_si256();
+    }
+    // The parameter block for a 64 byte unkeyed hash is 0x01010040 followed by 0's
+    __m256i h[8];
+    h[0] = _mm256_set1_epi64x(blake2b_IV[0] ^ 0x01010040);
+    for(uint32_t i = 1; i < 8; i++) {
+        h[i] = _mm256_set1_epi64x(blake2b_IV[i]);
+    }
+    __m256i v[16];
+    for(uint32_t i = 0; i < 8; i++) {
+        v[i] = h[i];
+    }
+    v[8] = _mm256_set1_epi64x(blake2b_IV[0]);
+    v[9] = _mm256_set1_epi64x(blake2b_IV[1]);
+    v[10] = _mm256_set1_epi64x(blake2b_IV[2]);
+    v[11] = _mm256_set1_epi64x(blake2b_IV[3]);
+    v[12] = _mm256_set1_epi64x(blake2b_IV[4] ^ (16*sizeof(uint32_t) + sizeof(uint32_t)));
+    v[13] = _mm256_set1_epi64x(blake2b_IV[5]);
+    v[14] = _mm256_set1_epi64x(~blake2b_IV[6]); // This is the last block
+    v[15] = _mm256_set1_epi64x(blake2b_IV[7]);
+    for(uint32_t r = 0; r < 12; r++) {
+        const uint8_t *s = blake2b_sigma[r];
+        BATCH_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        BATCH_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        BATCH_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        BATCH_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        BATCH_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        BATCH_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        BATCH_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        BATCH_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+    for(uint32_t i = 0; i < 8; i++) {
+        h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+    }
+    transpose4x4(h);
+    transpose4x4(h + 4);
+    for(uint32_t i = 0; i < 4; i++) {
+        _mm256_storeu_si256((__m256i *)states[i], h[i]);
+        _mm256_storeu_si256((__m256i *)(states[i] + 8), h[i + 4]);
+    }
+}
+
+// Expand a fixed length hash to a variable length hash of uint32_t's.  Each 16 word chunk
+// of the output is the hash of hash32 and its index, independent of the others, so we
+// hash 4 chunks at a time.
+static bool expandUint32(TwoCats_H *H, uint32_t *out, uint32_t outlen, const uint32_t *hash32) {
+    uint32_t numChunks = outlen/16;
+    for(uint32_t i = 0; i < numChunks; i++) {
+        memcpy(out + i*16, hash32, 16*sizeof(uint32_t));
+    }
+    uint32_t i = 0;
+    for(; i + 4 <= numChunks; i += 4) {
+        uint32_t *states[4];
+        uint32_t values[4];
+        for(uint32_t j = 0; j < 4; j++) {
+            states[j] = out + (i + j)*16;
+            values[j] = i + j;
+        }
+        hashStates4(states, values);
+    }
+    for(; i < numChunks; i++) {
+        if(!H->HashState(H, out + i*16, i)) {
+            return false;
+        }
+    }
+    return true;
+}
 #endif
 
 // Initilized the state.
@@ -21,12 +146,49 @@ static bool final(TwoCats_H *H, uint8_t *hash) {
     return !blake2b_final(&(H->c.blake2bState), hash, 64);
 }
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// The chaining value after initializing for a 64 byte unkeyed hash: the IV xored with a
+// parameter block that is 0x01010040 followed by 0's.
+static const uint64_t hashStateH0[8] = {
+    0x6a09e667f3bcc908ULL ^ 0x01010040, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+// Scramble the state, including a single uint32_t value.  This computes the same hash as
+// the generic hashState in twocats-common.c, but the 68 byte message fits in one block,
+// so we skip Init, Update, and Final and do a single compression.  The state is already
+// little-endian in memory, so there is nothing to encode.  Some compress functions read
+// the block as uint64_t, so that is how we declare it.
+static bool hashState(TwoCats_H *H, uint32_t *state, uint32_t value) {
+    blake2b_state S;
+    uint64_t block[BLAKE2B_BLOCKBYTES/sizeof(uint64_t)] = {0};
+    memcpy(block, state, 64);
+    block[8] = value;
+    memcpy(S.h, hashStateH0, sizeof(hashStateH0));
+    S.t[0] = 64 + sizeof(uint32_t);
+    S.t[1] = 0;
+    S.f[0] = ~(uint64_t)0; // This is the last block
+    S.f[1] = 0;
+    blake2b_compress(&S, (uint8_t *)block);
+    memcpy(state, S.h, 64);
+    return true;
+}
+#endif
+
 // Initialize the hashing object for Blake2b hashing.
-void TwoCats_InitBlake2b(TwoCats_H *H) {
+void TWOCATS_ISA_NAME(TwoCats_InitBlake2b)(TwoCats_H *H) {
     H->name = "blake2b";
     H->size = 64;
     H->Init = init;
     H->Update = update;
     H->Final = final;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    H->HashState = hashState;
+#endif
+#if defined(__AVX2__)
+    H->ExpandUint32 = expandUint32;
+#endif
 }
 
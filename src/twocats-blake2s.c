@@ -1,10 +1,131 @@
+// This file is compiled once per instruction set with -DTWOCATS_ISA=<name>, so give each
+// copy of the Blake2s library its own names.
+#define blake2s_init_param TWOCATS_ISA_NAME(blake2s_init_param)
+#define blake2s_init_key TWOCATS_ISA_NAME(blake2s_init_key)
+#define blake2s_init TWOCATS_ISA_NAME(blake2s_init)
+#define blake2s_update TWOCATS_ISA_NAME(blake2s_update)
+#define blake2s_final TWOCATS_ISA_NAME(blake2s_final)
+#define blake2s TWOCATS_ISA_NAME(blake2s)
+
 #include "twocats-internal.h"
 
-#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(TWOCATS_NO_SIMD)
+#include "../blake2-ref/blake2s-ref.c"
+#else
 #include "../blake2-sse/blake2s.c"
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#if defined(__AVX512VL__)
+#define BATCH_ROTR(x, n) _mm256_ror_epi32(x, n)
 #else
-#include "../blake2-ref/blake2s-ref.c"
+#define BATCH_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#endif
+
+// The Blake2s G function on 8 messages at once, one in each 32-bit lane.
+#define BATCH_G(a, b, c, d, x, y) \
+    do { \
+        a = _mm256_add_epi32(_mm256_add_epi32(a, b), x); \
+        d = BATCH_ROTR(_mm256_xor_si256(d, a), 16); \
+        c = _mm256_add_epi32(c, d); \
+        b = BATCH_ROTR(_mm256_xor_si256(b, c), 12); \
+        a = _mm256_add_epi32(_mm256_add_epi32(a, b), y); \
+        d = BATCH_ROTR(_mm256_xor_si256(d, a), 8); \
+        c = _mm256_add_epi32(c, d); \
+        b = BATCH_ROTR(_mm256_xor_si256(b, c), 7); \
+    } while(0)
+
+// Transpose 8 rows of 8 uint32_t's.
+static inline void transpose8x8(__m256i r[8]) {
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+#endif
+
+// Do what H->HashState does for 8 Blake2s states at once, hashing values[i] into
+// states[i].  The 36 byte message fits in one Blake2s block, so each state takes a
+// single compression, and with AVX2 we do all 8 compressions together.
+void TWOCATS_ISA_NAME(TwoCats_Blake2sHashStates8)(uint32_t *states[8],
+        const uint32_t values[8]) {
+#if defined(__AVX2__)
+    __m256i m[16];
+    for(uint32_t i = 0; i < 8; i++) {
+        m[i] = _mm256_loadu_si256((__m256i *)states[i]);
+    }
+    transpose8x8(m);
+    m[8] = _mm256_loadu_si256((__m256i *)values);
+    for(uint32_t i = 9; i < 16; i++) {
+        m[i] = _mm256_setzero_si256();
+    }
+    // The parameter block for a 32 byte unkeyed hash is 0x01010020 followed by 0's
+    __m256i h[8];
+    h[0] = _mm256_set1_epi32(blake2s_IV[0] ^ 0x01010020);
+    for(uint32_t i = 1; i < 8; i++) {
+        h[i] = _mm256_set1_epi32(blake2s_IV[i]);
+    }
+    __m256i v[16];
+    for(uint32_t i = 0; i < 8; i++) {
+        v[i] = h[i];
+    }
+    v[8] = _mm256_set1_epi32(blake2s_IV[0]);
+    v[9] = _mm256_set1_epi32(blake2s_IV[1]);
+    v[10] = _mm256_set1_epi32(blake2s_IV[2]);
+    v[11] = _mm256_set1_epi32(blake2s_IV[3]);
+    v[12] = _mm256_set1_epi32(blake2s_IV[4] ^ (8*sizeof(uint32_t) + sizeof(uint32_t)));
+    v[13] = _mm256_set1_epi32(blake2s_IV[5]);
+    v[14] = _mm256_set1_epi32(~blake2s_IV[6]); // This is the last block
+    v[15] = _mm256_set1_epi32(blake2s_IV[7]);
+    for(uint32_t r = 0; r < 10; r++) {
+        const uint8_t *s = blake2s_sigma[r];
+        BATCH_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        BATCH_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        BATCH_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        BATCH_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        BATCH_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        BATCH_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        BATCH_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        BATCH_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+    for(uint32_t i = 0; i < 8; i++) {
+        h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+    }
+    transpose8x8(h);
+    for(uint32_t i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *)states[i], h[i]);
+    }
+#else
+    TwoCats_H H;
+    TwoCats_InitHash(&H, TWOCATS_BLAKE2S);
+    TWOCATS_ISA_NAME(TwoCats_InitBlake2s)(&H);
+    for(uint32_t i = 0; i < 8; i++) {
+        H.HashState(&H, states[i], values[i]);
+    }
 #endif
+}
 
 // Initilized the state.
 static bool init(TwoCats_H *H) {
@@ -21,12 +142,74 @@ static bool final(TwoCats_H *H, uint8_t *hash) {
     return !blake2s_final(&(H->c.blake2sState), hash, 32);
 }
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// The chaining value after initializing for a 32 byte unkeyed hash: the IV xored with a
+// parameter block that is 0x01010020 followed by 0's.
+static const uint32_t hashStateH0[8] = {
+    0x6A09E667 ^ 0x01010020, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+// Scramble the state, including a single uint32_t value.  This computes the same hash as
+// the generic hashState in twocats-common.c, but the 36 byte message fits in one block,
+// so we skip Init, Update, and Final and do a single compression.  The state is already
+// little-endian in memory, so there is nothing to encode.
+static bool hashState(TwoCats_H *H, uint32_t *state, uint32_t value) {
+    blake2s_state S;
+    uint32_t block[BLAKE2S_BLOCKBYTES/sizeof(uint32_t)] = {0};
+    memcpy(block, state, 32);
+    block[8] = value;
+    memcpy(S.h, hashStateH0, sizeof(hashStateH0));
+    S.t[0] = 32 + sizeof(uint32_t);
+    S.t[1] = 0;
+    S.f[0] = ~(uint32_t)0; // This is the last block
+    S.f[1] = 0;
+    blake2s_compress(&S, (uint8_t *)block);
+    memcpy(state, S.h, 32);
+    return true;
+}
+#endif
+
+#if defined(__AVX2__)
+// Expand a fixed length hash to a variable length hash of uint32_t's.  Each 8 word chunk
+// of the output is the hash of hash32 and its index, independent of the others, so we
+// hash 8 chunks at a time.
+static bool expandUint32(TwoCats_H *H, uint32_t *out, uint32_t outlen, const uint32_t *hash32) {
+    uint32_t numChunks = outlen/8;
+    for(uint32_t i = 0; i < numChunks; i++) {
+        memcpy(out + i*8, hash32, 8*sizeof(uint32_t));
+    }
+    uint32_t i = 0;
+    for(; i + 8 <= numChunks; i += 8) {
+        uint32_t *states[8];
+        uint32_t values[8];
+        for(uint32_t j = 0; j < 8; j++) {
+            states[j] = out + (i + j)*8;
+            values[j] = i + j;
+        }
+        TWOCATS_ISA_NAME(TwoCats_Blake2sHashStates8)(states, values);
+    }
+    for(; i < numChunks; i++) {
+        if(!H->HashState(H, out + i*8, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
 // Initialize the hashing object for Blake2s hashing.
-void TwoCats_InitBlake2s(TwoCats_H *H) {
+void TWOCATS_ISA_NAME(TwoCats_InitBlake2s)(TwoCats_H *H) {
     H->name = "blake2s";
     H->size = 32;
     H->Init = init;
     H->Update = update;
     H->Final = final;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    H->HashState = hashState;
+#endif
+#if defined(__AVX2__)
+    H->ExpandUint32 = expandUint32;
+#endif
 }
 
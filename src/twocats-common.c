@@ -11,11 +11,13 @@
    this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
+#include <unistd.h>
 #include "twocats-internal.h"
 
 // Print the state.
@@ -97,7 +99,7 @@ static bool hashState(TwoCats_H *H, uint32_t *state, uint32_t value) {
 static bool expandUint32(TwoCats_H *H, uint32_t *out, uint32_t outlen, const uint32_t *hash32) { 
     for(uint32_t i = 0; i < outlen/H->len; i++) {
         memcpy(out + i*H->len, hash32, H->len*sizeof(uint32_t));
-        if(!hashState(H, out + i*H->len, i)) {
+        if(!H->HashState(H, out + i*H->len, i)) {
             return false;
         }
     }
@@ -214,6 +216,23 @@ static bool verifyParameters(TwoCats_H *H, uint8_t startMemCost, uint8_t stopMem
     return true;
 }
 
+// Reduce blockSize, and then parallelism, until each thread hashes at least
+// TWOCATS_MINBLOCKS blocks of the 2^memCost KiB.
+static void fitBlocks(uint8_t memCost, uint8_t *parallelism, uint32_t *blockSize,
+        uint32_t *subBlockSize) {
+    uint64_t memSize = (uint64_t)1024 << memCost;
+    while(*blockSize >= 64 && memSize/(*parallelism*(uint64_t)*blockSize) < TWOCATS_MINBLOCKS) {
+        *blockSize >>= 1;
+    }
+    if(*subBlockSize > *blockSize) {
+        *subBlockSize = *blockSize;
+    }
+    while(*parallelism > 1 &&
+            memSize/(*parallelism*(uint64_t)*blockSize) < TWOCATS_MINBLOCKS) {
+        (*parallelism)--;
+    }
+}
+
 // A simple password hashing interface.
 bool TwoCats_HashPassword(uint8_t *hash, uint8_t *password, uint32_t passwordSize,
         uint8_t *salt, uint32_t saltSize, uint8_t memCost) {
@@ -226,26 +245,33 @@ bool TwoCats_HashPasswordFull(TwoCats_HashType hashType, uint8_t *hash, uint8_t
         uint32_t passwordSize, uint8_t *salt, uint32_t saltSize, uint8_t memCost,
         uint8_t parallelism, bool sideChannelResistant) {
 
+    if(TwoCats_ProfileFailed()) {
+        // Hashing with the defaults instead would give the wrong hashes
+        fprintf(stderr, "Unable to load the tuning profile in $%s\n", TWOCATS_PROFILE_ENV);
+        return false;
+    }
     uint8_t multiplies = 3; // Decent match for Intel Sandy Bridge through Haswell
     if(memCost <= 4) {
         multiplies = 1; // Assume it fits in L1 cache
     } else if(memCost < 10) {
         multiplies = 2; // Assume it fits in L2 or L3 cache
     }
+    uint8_t lanes = TWOCATS_LANES;
     uint32_t blockSize = TWOCATS_BLOCKSIZE;
     uint32_t subBlockSize = TWOCATS_SUBBLOCKSIZE;
-    uint64_t memSize = (uint64_t)1024 << memCost;
-    while(blockSize >= 64 && memSize/(parallelism*blockSize) < TWOCATS_MINBLOCKS) {
-        blockSize >>= 1;
+    TwoCats_Parameters params;
+    if(TwoCats_GetProfileParameters(hashType, &params)) {
+        multiplies = params.multiplies;
+        lanes = params.lanes;
+        blockSize = params.blockSize;
+        subBlockSize = params.subBlockSize;
     }
-    if(subBlockSize > blockSize) {
-        subBlockSize = blockSize;
-    }
-    while(parallelism > 1 && memSize/(parallelism*blockSize) < TWOCATS_MINBLOCKS) {
-        parallelism--;
+    fitBlocks(memCost, &parallelism, &blockSize, &subBlockSize);
+    while(lanes > 1 && subBlockSize < 4*lanes) {
+        lanes >>= 1;
     }
     return TwoCats_HashPasswordExtended(NULL, hashType, hash, password, passwordSize,
-        salt, saltSize, NULL, 0, memCost, memCost, multiplies, TWOCATS_LANES, parallelism,
+        salt, saltSize, NULL, 0, memCost, memCost, multiplies, lanes, parallelism,
         blockSize, subBlockSize, TWOCATS_OVERWRITECOST, false, sideChannelResistant);
 }
 
@@ -285,6 +311,33 @@ bool TwoCats_UpdatePassword(TwoCats_HashType hashType, uint8_t *hash, uint8_t ol
     return TwoCats_ServerHashPassword(hashType, hash);
 }
 
+// Convert overwiteCost from relative to startMemCost to absolute.
+static uint8_t absoluteOverwriteCost(uint8_t startMemCost, uint8_t overwriteCost) {
+    if(overwriteCost >= startMemCost) {
+        return 0;
+    } else if(overwriteCost != 0) {
+        return startMemCost - overwriteCost;
+    }
+    return 0;
+}
+
+// Hash all the inputs, other than stopMemCost, into hash32.  overwriteCost is absolute.
+static bool hashInputs(TwoCats_H *H, uint32_t *hash32, uint8_t *password,
+        uint32_t passwordSize, uint8_t *salt, uint32_t saltSize, uint8_t *data,
+        uint32_t dataSize, uint8_t startMemCost, uint8_t multiplies, uint8_t lanes,
+        uint8_t parallelism, uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost,
+        bool sideChannelResistant) {
+    uint8_t sideChannel = sideChannelResistant? 1 : 0;
+    return H->Init(H)                            && H->UpdateUint32(H, passwordSize) &&
+            H->UpdateUint32(H, saltSize)         && H->UpdateUint32(H, dataSize) &&
+            H->UpdateUint32(H, blockSize)        && H->UpdateUint32(H, subBlockSize) &&
+            H->Update(H, &startMemCost, 1)       && H->Update(H, &multiplies, 1) &&
+            H->Update(H, &lanes, 1)              && H->Update(H, &parallelism, 1) &&
+            H->Update(H, &overwriteCost, 1)      && H->Update(H, &sideChannel, 1) &&
+            H->Update(H, password, passwordSize) && H->Update(H, salt, saltSize) &&
+            H->Update(H, data, dataSize)         && H->FinalUint32(H, hash32);
+}
+
 // Client-side portion of work for server-relief mode.  Return true if there are no memory
 // allocation errors.  The password and data are not cleared if there is an error.
 bool TwoCats_ClientHashPassword(void *memory, TwoCats_HashType hashType, uint8_t *hash,
@@ -299,25 +352,13 @@ bool TwoCats_ClientHashPassword(void *memory, TwoCats_HashType hashType, uint8_t
             blockSize, subBlockSize)) {
         return false;
     }
-
-    // Convert overwiteCost from relative to startMemCost to absolute
-    if(overwriteCost >= startMemCost) {
-        overwriteCost = 0;
-    } else if(overwriteCost != 0) {
-        overwriteCost = startMemCost - overwriteCost;
-    }
+    overwriteCost = absoluteOverwriteCost(startMemCost, overwriteCost);
 
     // Add all the inputs, other than stopMemCost
     uint32_t hash32[H.len];
-    uint8_t sideChannel = sideChannelResistant? 1 : 0;
-    if(!H.Init(&H)                                || !H.UpdateUint32(&H, passwordSize) ||
-            !H.UpdateUint32(&H, saltSize)         || !H.UpdateUint32(&H, dataSize) ||
-            !H.UpdateUint32(&H, blockSize)        || !H.UpdateUint32(&H, subBlockSize) ||
-            !H.Update(&H, &startMemCost, 1)       || !H.Update(&H, &multiplies, 1) ||
-            !H.Update(&H, &lanes, 1)              || !H.Update(&H, &parallelism, 1) ||
-            !H.Update(&H, &overwriteCost, 1)      || !H.Update(&H, &sideChannel, 1) ||
-            !H.Update(&H, password, passwordSize) || !H.Update(&H, salt, saltSize) ||
-            !H.Update(&H, data, dataSize)         || !H.FinalUint32(&H, hash32)) {
+    if(!hashInputs(&H, hash32, password, passwordSize, salt, saltSize, data, dataSize,
+            startMemCost, multiplies, lanes, parallelism, blockSize, subBlockSize,
+            overwriteCost, sideChannelResistant)) {
         return false;
     }
 
@@ -344,6 +385,52 @@ bool TwoCats_ServerHashPassword(TwoCats_HashType hashType, uint8_t *hash) {
     return H.Init(&H) && H.Update(&H, hash, H.size) && H.Final(&H, hash);
 }
 
+// Hash many passwords with the same parameters.  The results are the same as calling
+// TwoCats_HashPasswordExtended on each with no data.
+bool TwoCats_HashPasswordBatch(TwoCats_HashType hashType, uint32_t numPasswords,
+        uint8_t **hashes, uint8_t **passwords, uint32_t *passwordSizes, uint8_t **salts,
+        uint32_t *saltSizes, uint8_t startMemCost, uint8_t stopMemCost, uint8_t multiplies,
+        uint8_t lanes, uint8_t parallelism, uint32_t blockSize, uint32_t subBlockSize,
+        uint8_t overwriteCost, bool sideChannelResistant) {
+
+    TwoCats_H H;
+    TwoCats_InitHash(&H, hashType);
+    if(!verifyParameters(&H, startMemCost, stopMemCost, multiplies, lanes, parallelism,
+            blockSize, subBlockSize)) {
+        return false;
+    }
+    overwriteCost = absoluteOverwriteCost(startMemCost, overwriteCost);
+    uint32_t *hash32Buf = malloc((uint64_t)numPasswords*H.size);
+    uint32_t **hash32s = malloc((uint64_t)numPasswords*sizeof(uint32_t *));
+    if(hash32Buf == NULL || hash32s == NULL) {
+        free(hash32Buf);
+        free(hash32s);
+        return false;
+    }
+    bool result = true;
+    for(uint32_t i = 0; i < numPasswords && result; i++) {
+        hash32s[i] = hash32Buf + i*H.len;
+        result = hashInputs(&H, hash32s[i], passwords[i], passwordSizes[i], salts[i],
+            saltSizes[i], NULL, 0, startMemCost, multiplies, lanes, parallelism, blockSize,
+            subBlockSize, overwriteCost, sideChannelResistant);
+        secureZeroMemory(passwords[i], passwordSizes[i]);
+        secureZeroMemory(salts[i], saltSizes[i]);
+    }
+    if(result) {
+        result = TwoCats_Batch(&H, hash32s, numPasswords, startMemCost, stopMemCost,
+            multiplies, lanes, parallelism, blockSize, subBlockSize, overwriteCost,
+            sideChannelResistant);
+    }
+    for(uint32_t i = 0; i < numPasswords && result; i++) {
+        encodeLittleEndian(hashes[i], hash32s[i], H.size);
+        result = TwoCats_ServerHashPassword(hashType, hashes[i]);
+    }
+    secureZeroMemory(hash32Buf, numPasswords*H.size);
+    free(hash32Buf);
+    free(hash32s);
+    return result;
+}
+
 // This is the prototype required for the password hashing competition.
 // t_cost is a multiplier on CPU work.  m_cost is garlic.
 // If possible, call TwoCats_SimpleHashPassword instead so that the password can be cleared.
@@ -365,64 +452,242 @@ int PHS(void *out, size_t outlen, const void *in, size_t inlen, const void *salt
     return result;
 }
 
+// The number of times calibration times each setting.
+#define TWOCATS_CALIBRATIONSAMPLES 5
+
+// A setting must be this much faster than the best so far to replace it, so that noise
+// does not decide between settings that run about as fast.
+#define TWOCATS_CALIBRATIONMARGIN 0.95
+
+// Return the wall-clock time in milliseconds.  Unlike clock(), which adds up the CPU time
+// of every thread, this is what the user waits for when parallelism > 1.
+static double getMilliseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000.0 + t.tv_nsec/1000000.0;
+}
+
+// Hash TWOCATS_CALIBRATIONSAMPLES times with the parameters, and set their runtime to the
+// median and runtimeVariance to the variance.  Return false if memory allocation fails.
+static bool timeParameters(TwoCats_Parameters *params) {
+    uint32_t keySize = TwoCats_GetHashTypeSize(params->hashType);
+    uint8_t buf[keySize];
+    double times[TWOCATS_CALIBRATIONSAMPLES];
+    double sum = 0.0;
+    for(uint32_t i = 0; i < TWOCATS_CALIBRATIONSAMPLES; i++) {
+        double start = getMilliseconds();
+        if(!TwoCats_HashPasswordExtended(NULL, params->hashType, buf, NULL, 0, NULL, 0, NULL,
+                0, params->memCost, params->memCost, params->multiplies, params->lanes,
+                params->parallelism, params->blockSize, params->subBlockSize, 0, false,
+                false)) {
+            fprintf(stderr, "Memory hashing failed\n");
+            return false;
+        }
+        double time = getMilliseconds() - start;
+        // Insertion sort, since there are only a few
+        uint32_t j = i;
+        while(j > 0 && times[j - 1] > time) {
+            times[j] = times[j - 1];
+            j--;
+        }
+        times[j] = time;
+        sum += time;
+    }
+    double mean = sum/TWOCATS_CALIBRATIONSAMPLES;
+    double variance = 0.0;
+    for(uint32_t i = 0; i < TWOCATS_CALIBRATIONSAMPLES; i++) {
+        variance += (times[i] - mean)*(times[i] - mean);
+    }
+    params->runtimeVariance = variance/TWOCATS_CALIBRATIONSAMPLES;
+    params->runtime = times[TWOCATS_CALIBRATIONSAMPLES/2];
+    return true;
+}
+
 // Just measure the time for a given memCost and timeCost.  Return -1 if memory allocation fails.
-static clock_t findRuntime(TwoCats_HashType hashType, uint8_t memCost, uint8_t multiplies,
+static double findRuntime(TwoCats_HashType hashType, uint8_t memCost, uint8_t multiplies,
         uint8_t lanes) {
-    uint32_t keySize = TwoCats_GetHashTypeSize(hashType);
-    uint8_t buf[keySize];
-    clock_t start = clock();
-    if(!TwoCats_HashPasswordExtended(NULL, hashType, buf, NULL, 0, NULL, 0, NULL, 0, memCost,
-            memCost, multiplies, lanes, TWOCATS_PARALLELISM, TWOCATS_BLOCKSIZE,
-            TWOCATS_SUBBLOCKSIZE, 0, false, false)) {
-        fprintf(stderr, "Memory hashing failed\n");
-        return -1;
+    TwoCats_Parameters params = {hashType, memCost, multiplies, lanes, TWOCATS_PARALLELISM,
+        TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE, 0.0, 0.0};
+    if(!timeParameters(&params)) {
+        return -1.0;
     }
-    clock_t end = clock();
-    return (end - start) * 1000 / CLOCKS_PER_SEC;
+    return params.runtime;
 }
 
 // Find a good memCost for a given time on this machine.  This just finds the largest
-// memCost that runs in less than milliseconds ms.  Return 255 on failure to allocate memory.
+// memCost that runs in less than milliseconds ms.
 static uint8_t findMemCost(TwoCats_HashType hashType, uint32_t milliseconds, uint32_t
-        maxMem, clock_t *finalTime, uint8_t lanes) {
+        maxMem, double *finalTime, uint8_t lanes) {
     // First, find a decent memCost
     uint8_t memCost = 0;
-    clock_t runtime = findRuntime(hashType, memCost, 0, lanes);
-    while(runtime < milliseconds && (1 << memCost) <= maxMem) {
+    double runtime = findRuntime(hashType, memCost, 0, lanes);
+    while(runtime >= 0.0 && runtime < milliseconds && (1 << memCost) <= maxMem) {
         memCost++;
         if(runtime < milliseconds/8) {
             memCost++;
         }
         runtime = findRuntime(hashType, memCost, 0, lanes);
-        //printf("New findMemCost runtime: %u\n", runtime);
+        //printf("New findMemCost runtime: %f\n", runtime);
     }
     *finalTime = runtime;
     return memCost;
 }
 
+// Pick lanes.  If we have good custom code for it, use it.
+static uint8_t findLanes(TwoCats_HashType hashType) {
+    switch(TwoCats_GetImplementation()) {
+    case TWOCATS_IMPL_AVX512:
+        return TwoCats_GetHashTypeSize(hashType) >= 64? 16 : 8;
+    case TWOCATS_IMPL_AVX2:
+        return 8;
+    case TWOCATS_IMPL_GENERIC:
+        return 1;
+    default:
+        return 4;
+    }
+}
+
 // Find parameter settings on this machine for a given desired runtime and maximum memory
 // usage.  maxMem is in KiB.  Runtime with be typically +/- 50% and memory will be <= maxMem.
 void TwoCats_FindCostParameters(TwoCats_HashType hashType, uint32_t milliseconds, uint32_t
         maxMem, uint8_t *memCost, uint8_t *multiplies, uint8_t *lanes) {
 
-// Lanes is simplest to pick.  If we have good custom code for it, use it.
-#if defined(__AVX2__)
-    *lanes = 8;
-#elif defined(__SSE2__)
-    *lanes = 4;
-#else
-    *lanes = 1;
-#endif
-
-    clock_t runtime;
+    *lanes = findLanes(hashType);
+    double runtime;
     *memCost = findMemCost(hashType, milliseconds/8, maxMem/8, &runtime, *lanes);
-    clock_t initialRuntime = findRuntime(hashType, *memCost, 0, *lanes);
+    double initialRuntime = findRuntime(hashType, *memCost, 0, *lanes);
 
     // Increase multiplies until they start to slow us down
     *multiplies = 0;
     do {
         *multiplies += 1;
         runtime = findRuntime(hashType, *memCost, *multiplies, *lanes);
-        //printf("New multiply runtime: %u\n", runtime);
+        //printf("New multiply runtime: %f\n", runtime);
     } while(runtime < 1.05*initialRuntime && *multiplies < 8);
 }
+
+// Time the candidate parameters, and make them the best if they are faster.  Parameters
+// that give a thread too few blocks are skipped.  Return false if memory allocation fails.
+static bool tryParameters(TwoCats_Parameters *best, TwoCats_Parameters *candidate) {
+    uint64_t memSize = (uint64_t)1024 << candidate->memCost;
+    if(candidate->subBlockSize < 4*candidate->lanes ||
+            candidate->subBlockSize > candidate->blockSize ||
+            memSize/(candidate->parallelism*(uint64_t)candidate->blockSize) < TWOCATS_MINBLOCKS) {
+        return true;
+    }
+    if(!timeParameters(candidate)) {
+        return false;
+    }
+    if(candidate->runtime < TWOCATS_CALIBRATIONMARGIN*best->runtime) {
+        *best = *candidate;
+    }
+    return true;
+}
+
+// Find parameters that hash the most memory in at most milliseconds on this machine.  This
+// searches one parameter at a time with a memCost that takes about 1/8 of the time, and
+// then scales memCost up.
+bool TwoCats_CalibrateParameters(TwoCats_HashType hashType, uint32_t milliseconds,
+        uint32_t maxMem, uint8_t maxParallelism, TwoCats_Parameters *params) {
+    if(maxParallelism == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        maxParallelism = cpus < 1? 1 : cpus > 255? 255 : cpus;
+    }
+    uint8_t lanes = findLanes(hashType);
+    // Start from the block sizes that suit the caches
+    TwoCats_Parameters best = {hashType, 0, 0, lanes, 1, 0, 0, 0.0, 0.0};
+    TwoCats_FindBlockSizes(lanes, maxParallelism, &best.blockSize, &best.subBlockSize);
+    // Blocks must be at least one sub-block
+    uint8_t minMemCost = 0;
+    while(((uint64_t)1024 << minMemCost) < (uint64_t)TWOCATS_MINBLOCKS*best.subBlockSize) {
+        minMemCost++;
+    }
+    best.memCost = minMemCost;
+    fitBlocks(best.memCost, &best.parallelism, &best.blockSize, &best.subBlockSize);
+    if(!timeParameters(&best)) {
+        return false;
+    }
+    while(best.memCost < 30 && ((uint64_t)2 << best.memCost) <= maxMem/8 &&
+            best.runtime < milliseconds/8.0) {
+        best.memCost++;
+        TwoCats_FindBlockSizes(lanes, maxParallelism, &best.blockSize, &best.subBlockSize);
+        fitBlocks(best.memCost, &best.parallelism, &best.blockSize, &best.subBlockSize);
+        if(!timeParameters(&best)) {
+            return false;
+        }
+    }
+
+    // Parallelism matters most, then the block sizes
+    TwoCats_Parameters candidate = best;
+    for(uint32_t parallelism = 2; parallelism < 2*(uint32_t)maxParallelism; parallelism <<= 1) {
+        candidate = best;
+        candidate.parallelism = parallelism < maxParallelism? parallelism : maxParallelism;
+        if(!tryParameters(&best, &candidate)) {
+            return false;
+        }
+    }
+    uint32_t blockSize = best.blockSize;
+    for(uint32_t size = 4096; size <= (1 << 20); size <<= 1) {
+        candidate = best;
+        candidate.blockSize = size;
+        if(size != blockSize && !tryParameters(&best, &candidate)) {
+            return false;
+        }
+    }
+    uint32_t subBlockSize = best.subBlockSize;
+    for(uint32_t size = 32; size <= 1024; size <<= 1) {
+        candidate = best;
+        candidate.subBlockSize = size;
+        if(size != subBlockSize && !tryParameters(&best, &candidate)) {
+            return false;
+        }
+    }
+
+    // Increase multiplies until they start to slow us down, but always do some, like
+    // TwoCats_FindCostParameters
+    double initialRuntime = best.runtime;
+    while(best.multiplies < 8) {
+        candidate = best;
+        candidate.multiplies++;
+        if(!timeParameters(&candidate)) {
+            return false;
+        }
+        if(candidate.multiplies > 1 &&
+                candidate.runtime*TWOCATS_CALIBRATIONMARGIN > initialRuntime) {
+            break;
+        }
+        best = candidate;
+    }
+
+    // Each memCost doubles the runtime, so estimate the final memCost, and then correct
+    // it by timing it.
+    while(best.memCost < 30 && ((uint64_t)2 << best.memCost) <= maxMem &&
+            2*best.runtime <= milliseconds) {
+        best.memCost++;
+        best.runtime *= 2;
+    }
+    if(!timeParameters(&best)) {
+        return false;
+    }
+    while(best.runtime > milliseconds && best.memCost > minMemCost) {
+        best.memCost--;
+        fitBlocks(best.memCost, &best.parallelism, &best.blockSize, &best.subBlockSize);
+        if(!timeParameters(&best)) {
+            return false;
+        }
+    }
+    while(best.memCost < 30 && ((uint64_t)2 << best.memCost) <= maxMem &&
+            2*best.runtime <= milliseconds) {
+        candidate = best;
+        candidate.memCost++;
+        if(!timeParameters(&candidate)) {
+            return false;
+        }
+        if(candidate.runtime > milliseconds) {
+            break;
+        }
+        best = candidate;
+    }
+    *params = best;
+    return true;
+}
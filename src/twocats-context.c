@@ -0,0 +1,188 @@
+/*
+   TwoCats hashing contexts, which keep hashing memory between calls.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "twocats-internal.h"
+
+// Memory costs go from 0 through 30.
+#define TWOCATS_MAXMEMCOST 30
+
+// A buffer of 2^memCost KiB, either free in the context or in use by a hash.
+struct TwoCatsBufferStruct {
+    void *mem;
+    TwoCats_PageMode pageMode;
+    struct TwoCatsBufferStruct *next;
+};
+
+// Free buffers are kept in a list for each memCost.
+struct TwoCatsHashContextStruct {
+    pthread_mutex_t mutex;
+    struct TwoCatsBufferStruct *freeBuffers[TWOCATS_MAXMEMCOST + 1];
+    uint32_t numBuffers[TWOCATS_MAXMEMCOST + 1]; // Free and in use
+    TwoCats_PageMode minPageMode[TWOCATS_MAXMEMCOST + 1]; // Smallest pages we got
+    uint8_t parallelism;
+    TwoCats_PageMode pageMode;
+};
+
+// Create a context.  Return NULL if out of memory.
+TwoCats_Context *TwoCats_CreateContext(uint8_t parallelism, TwoCats_PageMode pageMode) {
+    TwoCats_Context *context = calloc(1, sizeof(TwoCats_Context));
+    if(context == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&context->mutex, NULL);
+    context->parallelism = parallelism == 0? 1 : parallelism;
+    context->pageMode = pageMode;
+    for(uint32_t memCost = 0; memCost <= TWOCATS_MAXMEMCOST; memCost++) {
+        context->minPageMode[memCost] = pageMode;
+    }
+    return context;
+}
+
+// Allocate and prefault a new buffer.  Return NULL if out of memory, or if it can't be
+// prefaulted.
+static struct TwoCatsBufferStruct *newBuffer(TwoCats_Context *context, uint8_t memCost) {
+    struct TwoCatsBufferStruct *buffer = malloc(sizeof(struct TwoCatsBufferStruct));
+    if(buffer == NULL) {
+        return NULL;
+    }
+    buffer->mem = TwoCats_AllocateMemory(memCost, context->pageMode, &buffer->pageMode);
+    if(buffer->mem == NULL) {
+        free(buffer);
+        return NULL;
+    }
+    if(!TwoCats_PrefaultMemory(buffer->mem, (uint64_t)1024 << memCost, context->parallelism)) {
+        TwoCats_FreeMemory(buffer->mem, memCost, buffer->pageMode);
+        free(buffer);
+        return NULL;
+    }
+    pthread_mutex_lock(&context->mutex);
+    if(buffer->pageMode < context->minPageMode[memCost]) {
+        context->minPageMode[memCost] = buffer->pageMode;
+    }
+    pthread_mutex_unlock(&context->mutex);
+    return buffer;
+}
+
+// Free a buffer.
+static void freeBuffer(struct TwoCatsBufferStruct *buffer, uint8_t memCost) {
+    TwoCats_FreeMemory(buffer->mem, memCost, buffer->pageMode);
+    free(buffer);
+}
+
+// Put a buffer in the free list.
+static void releaseBuffer(TwoCats_Context *context, uint8_t memCost,
+        struct TwoCatsBufferStruct *buffer) {
+    pthread_mutex_lock(&context->mutex);
+    buffer->next = context->freeBuffers[memCost];
+    context->freeBuffers[memCost] = buffer;
+    pthread_mutex_unlock(&context->mutex);
+}
+
+// Take a buffer from the free list, or allocate a new one if none are free.
+static struct TwoCatsBufferStruct *acquireBuffer(TwoCats_Context *context, uint8_t memCost) {
+    pthread_mutex_lock(&context->mutex);
+    struct TwoCatsBufferStruct *buffer = context->freeBuffers[memCost];
+    if(buffer != NULL) {
+        context->freeBuffers[memCost] = buffer->next;
+    } else {
+        // Count it now, so other threads don't also think they need to allocate one
+        context->numBuffers[memCost]++;
+    }
+    pthread_mutex_unlock(&context->mutex);
+    if(buffer != NULL) {
+        return buffer;
+    }
+    buffer = newBuffer(context, memCost);
+    if(buffer == NULL) {
+        pthread_mutex_lock(&context->mutex);
+        context->numBuffers[memCost]--;
+        pthread_mutex_unlock(&context->mutex);
+    }
+    return buffer;
+}
+
+// Make sure at least numBuffers buffers of 2^memCost KiB are allocated and prefaulted,
+// and report the smallest pages any of them got.  Return false if out of memory.
+bool TwoCats_ReserveContextMemory(TwoCats_Context *context, uint8_t memCost,
+        uint32_t numBuffers, TwoCats_PageMode *obtainedPageMode) {
+    if(memCost > TWOCATS_MAXMEMCOST) {
+        fprintf(stderr, "memCost must be <= %u\n", TWOCATS_MAXMEMCOST);
+        return false;
+    }
+    while(true) {
+        pthread_mutex_lock(&context->mutex);
+        bool done = context->numBuffers[memCost] >= numBuffers;
+        if(!done) {
+            context->numBuffers[memCost]++;
+        } else if(obtainedPageMode != NULL) {
+            *obtainedPageMode = context->minPageMode[memCost];
+        }
+        pthread_mutex_unlock(&context->mutex);
+        if(done) {
+            return true;
+        }
+        struct TwoCatsBufferStruct *buffer = newBuffer(context, memCost);
+        if(buffer == NULL) {
+            pthread_mutex_lock(&context->mutex);
+            context->numBuffers[memCost]--;
+            pthread_mutex_unlock(&context->mutex);
+            fprintf(stderr, "Unable to allocate memory\n");
+            return false;
+        }
+        releaseBuffer(context, memCost, buffer);
+    }
+}
+
+// Free the context and all of its memory.  No hashes may be running in it.
+void TwoCats_FreeContext(TwoCats_Context *context) {
+    if(context == NULL) {
+        return;
+    }
+    for(uint32_t memCost = 0; memCost <= TWOCATS_MAXMEMCOST; memCost++) {
+        struct TwoCatsBufferStruct *buffer = context->freeBuffers[memCost];
+        while(buffer != NULL) {
+            struct TwoCatsBufferStruct *next = buffer->next;
+            freeBuffer(buffer, memCost);
+            buffer = next;
+        }
+    }
+    pthread_mutex_destroy(&context->mutex);
+    free(context);
+}
+
+// The same as TwoCats_HashPasswordExtended, but hashing in a buffer from the context.
+bool TwoCats_HashPasswordContext(TwoCats_Context *context, TwoCats_HashType hashType,
+        uint8_t *hash, uint8_t *password, uint32_t passwordSize, uint8_t *salt,
+        uint32_t saltSize, uint8_t *data, uint32_t dataSize, uint8_t startMemCost,
+        uint8_t stopMemCost, uint8_t multiplies, uint8_t lanes, uint8_t parallelism,
+        uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost,
+        bool clearData, bool sideChannelResistant) {
+    if(stopMemCost > TWOCATS_MAXMEMCOST) {
+        fprintf(stderr, "stopMemCost must be <= %u\n", TWOCATS_MAXMEMCOST);
+        return false;
+    }
+    struct TwoCatsBufferStruct *buffer = acquireBuffer(context, stopMemCost);
+    if(buffer == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return false;
+    }
+    bool result = TwoCats_HashPasswordExtended(buffer->mem, hashType, hash, password,
+        passwordSize, salt, saltSize, data, dataSize, startMemCost, stopMemCost, multiplies,
+        lanes, parallelism, blockSize, subBlockSize, overwriteCost, clearData,
+        sideChannelResistant);
+    releaseBuffer(context, stopMemCost, buffer);
+    return result;
+}
@@ -0,0 +1,308 @@
+/*
+   TwoCats run-time CPU detection.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "twocats-internal.h"
+
+static TwoCats_Implementation bestImplementation = TWOCATS_IMPL_GENERIC;
+static TwoCats_Implementation currentImplementation = TWOCATS_IMPL_GENERIC;
+static TwoCats_StoreMode currentStoreMode = TWOCATS_STORES_AUTO;
+static TwoCats_CacheInfo cacheInfo;
+
+// Read a cache size like 32K or 105M from sysfs.  Return 0 if we can't.
+static uint64_t readCacheSize(char *fileName) {
+    FILE *file = fopen(fileName, "r");
+    if(file == NULL) {
+        return 0;
+    }
+    unsigned long long size = 0;
+    char suffix = '\0';
+    int numRead = fscanf(file, "%llu%c", &size, &suffix);
+    fclose(file);
+    if(numRead < 1) {
+        return 0;
+    }
+    switch(suffix) {
+    case 'K': return (uint64_t)size << 10;
+    case 'M': return (uint64_t)size << 20;
+    case 'G': return (uint64_t)size << 30;
+    default:;
+    }
+    return size;
+}
+
+// Count the CPUs in a sysfs list like 0-3,8.  Return 0 if we can't read it.
+static uint32_t readCpuCount(char *fileName) {
+    FILE *file = fopen(fileName, "r");
+    if(file == NULL) {
+        return 0;
+    }
+    uint32_t count = 0;
+    unsigned first, last;
+    int numRead;
+    while((numRead = fscanf(file, "%u-%u", &first, &last)) >= 1) {
+        count += numRead == 2 && last >= first? last - first + 1 : 1;
+        if(fgetc(file) != ',') {
+            break;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+// Find the sizes of CPU 0's caches.
+static void detectCaches(TwoCats_CacheInfo *info) {
+    uint32_t bestLevel = 0;
+    for(uint32_t index = 0; index < 16; index++) {
+        char fileName[80];
+        snprintf(fileName, sizeof(fileName), "/sys/devices/system/cpu/cpu0/cache/index%u/level", index);
+        FILE *file = fopen(fileName, "r");
+        if(file == NULL) {
+            break;
+        }
+        unsigned level = 0;
+        int numRead = fscanf(file, "%u", &level);
+        fclose(file);
+        snprintf(fileName, sizeof(fileName), "/sys/devices/system/cpu/cpu0/cache/index%u/type", index);
+        file = fopen(fileName, "r");
+        char type[16] = "";
+        if(file != NULL) {
+            if(fscanf(file, "%15s", type) != 1) {
+                type[0] = '\0';
+            }
+            fclose(file);
+        }
+        if(numRead != 1 || !strcmp(type, "Instruction")) {
+            continue;
+        }
+        snprintf(fileName, sizeof(fileName), "/sys/devices/system/cpu/cpu0/cache/index%u/size", index);
+        uint64_t size = readCacheSize(fileName);
+        if(size == 0) {
+            continue;
+        }
+        if(level == 1) {
+            info->l1DataSize = size;
+            snprintf(fileName, sizeof(fileName),
+                "/sys/devices/system/cpu/cpu0/cache/index%u/coherency_line_size", index);
+            info->lineSize = readCacheSize(fileName);
+        } else if(level == 2) {
+            info->l2Size = size;
+            snprintf(fileName, sizeof(fileName),
+                "/sys/devices/system/cpu/cpu0/cache/index%u/shared_cpu_list", index);
+            info->cpusPerL2 = readCpuCount(fileName);
+        }
+        if(level >= bestLevel) {
+            info->lastLevelSize = size;
+            bestLevel = level;
+        }
+    }
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+    // Without sysfs, glibc may know
+    if(info->l1DataSize == 0) {
+        long l1Size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+        long lineSize = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+        info->l1DataSize = l1Size > 0? l1Size : 0;
+        info->lineSize = lineSize > 0? lineSize : 0;
+    }
+    if(info->l2Size == 0) {
+        long l2Size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        info->l2Size = l2Size > 0? l2Size : 0;
+    }
+    if(info->lastLevelSize == 0) {
+        long l3Size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        info->lastLevelSize = l3Size > 0? l3Size : info->l2Size;
+    }
+#endif
+    if(info->cpusPerL2 == 0) {
+        info->cpusPerL2 = 1;
+    }
+}
+
+// Find the fastest implementation this CPU supports.  This runs when the library loads,
+// so the choice is made once rather than on every hash.
+static void __attribute__((constructor)) detectImplementation(void) {
+    TwoCats_Implementation impl = TWOCATS_IMPL_GENERIC;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+        impl = TWOCATS_IMPL_AVX512;
+    } else if(__builtin_cpu_supports("avx2")) {
+        impl = TWOCATS_IMPL_AVX2;
+    } else if(__builtin_cpu_supports("sse4.1")) {
+        impl = TWOCATS_IMPL_SSE41;
+    } else if(__builtin_cpu_supports("ssse3")) {
+        impl = TWOCATS_IMPL_SSSE3;
+    } else if(__builtin_cpu_supports("sse2")) {
+        impl = TWOCATS_IMPL_SSE2;
+    }
+#endif
+    bestImplementation = impl;
+    currentImplementation = impl;
+    detectCaches(&cacheInfo);
+}
+
+// Return the name of the implementation.
+char *TwoCats_GetImplementationName(TwoCats_Implementation impl) {
+    switch(impl) {
+    case TWOCATS_IMPL_GENERIC: return "generic";
+    case TWOCATS_IMPL_SSE2: return "sse2";
+    case TWOCATS_IMPL_SSSE3: return "ssse3";
+    case TWOCATS_IMPL_SSE41: return "sse41";
+    case TWOCATS_IMPL_AVX2: return "avx2";
+    case TWOCATS_IMPL_AVX512: return "avx512";
+    default:;
+    }
+    return NULL;
+}
+
+// Find an implementation with the given name.
+TwoCats_Implementation TwoCats_FindImplementation(char *name) {
+    for(TwoCats_Implementation impl = 0; impl < TWOCATS_IMPL_NONE; impl++) {
+        if(!strcasecmp(TwoCats_GetImplementationName(impl), name)) {
+            return impl;
+        }
+    }
+    return TWOCATS_IMPL_NONE;
+}
+
+// Each implementation needs every instruction set before it, so this is just a compare.
+bool TwoCats_ImplementationSupported(TwoCats_Implementation impl) {
+    return impl <= bestImplementation;
+}
+
+// Return the implementation in use.
+TwoCats_Implementation TwoCats_GetImplementation(void) {
+    return __atomic_load_n(&currentImplementation, __ATOMIC_RELAXED);
+}
+
+// Force an implementation.  Hashes already running keep the one they started with.
+bool TwoCats_SetImplementation(TwoCats_Implementation impl) {
+    if(impl >= TWOCATS_IMPL_NONE || !TwoCats_ImplementationSupported(impl)) {
+        return false;
+    }
+    __atomic_store_n(&currentImplementation, impl, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Return the name of the store mode.
+char *TwoCats_GetStoreModeName(TwoCats_StoreMode storeMode) {
+    switch(storeMode) {
+    case TWOCATS_STORES_AUTO: return "auto";
+    case TWOCATS_STORES_NORMAL: return "normal";
+    case TWOCATS_STORES_STREAMING: return "streaming";
+    default:;
+    }
+    return NULL;
+}
+
+// Find a store mode with the given name.
+TwoCats_StoreMode TwoCats_FindStoreMode(char *name) {
+    for(TwoCats_StoreMode storeMode = 0; storeMode < TWOCATS_STORES_NONE; storeMode++) {
+        if(!strcasecmp(TwoCats_GetStoreModeName(storeMode), name)) {
+            return storeMode;
+        }
+    }
+    return TWOCATS_STORES_NONE;
+}
+
+// Return the store mode in use.
+TwoCats_StoreMode TwoCats_GetStoreMode(void) {
+    return __atomic_load_n(&currentStoreMode, __ATOMIC_RELAXED);
+}
+
+// Set the store mode.  Hashes already running keep the one they started with.
+bool TwoCats_SetStoreMode(TwoCats_StoreMode storeMode) {
+    if(storeMode >= TWOCATS_STORES_NONE) {
+        return false;
+    }
+    __atomic_store_n(&currentStoreMode, storeMode, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Return the size of the last level cache in bytes, or 0 if unknown.
+uint64_t TwoCats_GetLastLevelCacheSize(void) {
+    return cacheInfo.lastLevelSize;
+}
+
+// Return the cache sizes found when the library loaded.
+void TwoCats_GetCacheInfo(TwoCats_CacheInfo *info) {
+    *info = cacheInfo;
+}
+
+// Pick the largest blockSize for which the previous, from, and to blocks of every thread
+// sharing an L2 cache fit in half of it, since the kernel reads the from block a sub-block
+// at a time at random, and those reads should hit in L2.  The other half is left for the
+// lines the prefetchers bring in.  Pick a subBlockSize of one cache line, so each random
+// read is one line.  tools/twocats-calibrate -s checks these against a sweep.
+void TwoCats_FindBlockSizes(uint8_t lanes, uint8_t parallelism, uint32_t *blockSize,
+        uint32_t *subBlockSize) {
+    *blockSize = TWOCATS_BLOCKSIZE;
+    *subBlockSize = TWOCATS_SUBBLOCKSIZE;
+    if(cacheInfo.l2Size != 0) {
+        uint32_t threads = parallelism < cacheInfo.cpusPerL2? parallelism : cacheInfo.cpusPerL2;
+        uint64_t maxBlockSize = cacheInfo.l2Size/(6*(uint64_t)(threads == 0? 1 : threads));
+        *blockSize = 1024;
+        while(*blockSize < (1 << 20) && 2*(uint64_t)*blockSize <= maxBlockSize) {
+            *blockSize <<= 1;
+        }
+    }
+    if(cacheInfo.lineSize != 0) {
+        *subBlockSize = 32;
+        while(*subBlockSize < cacheInfo.lineSize && *subBlockSize < 1024) {
+            *subBlockSize <<= 1;
+        }
+    }
+    while(*subBlockSize < 4*(uint32_t)lanes) {
+        *subBlockSize <<= 1;
+    }
+    if(*subBlockSize > *blockSize) {
+        *subBlockSize = *blockSize;
+    }
+}
+
+// Return true if hashing memSize bytes of memory should use streaming stores.  In auto
+// mode we stream when memory is bigger than the last level cache.  The generic kernel has
+// no streaming stores, so it would only pay for the extra copy.
+bool TwoCats_UseStreamingStores(uint64_t memSize) {
+    if(TwoCats_GetImplementation() == TWOCATS_IMPL_GENERIC) {
+        return false;
+    }
+    switch(TwoCats_GetStoreMode()) {
+    case TWOCATS_STORES_NORMAL: return false;
+    case TWOCATS_STORES_STREAMING: return true;
+    default:;
+    }
+    return cacheInfo.lastLevelSize != 0 && memSize > cacheInfo.lastLevelSize;
+}
+
+static void (*const initBlake2sFuncs[TWOCATS_IMPL_NONE])(TwoCats_H *H) = {
+    TwoCats_InitBlake2sGeneric, TwoCats_InitBlake2sSSE2, TwoCats_InitBlake2sSSSE3,
+    TwoCats_InitBlake2sSSE41, TwoCats_InitBlake2sAVX2, TwoCats_InitBlake2sAVX512};
+
+static void (*const initBlake2bFuncs[TWOCATS_IMPL_NONE])(TwoCats_H *H) = {
+    TwoCats_InitBlake2bGeneric, TwoCats_InitBlake2bSSE2, TwoCats_InitBlake2bSSSE3,
+    TwoCats_InitBlake2bSSE41, TwoCats_InitBlake2bAVX2, TwoCats_InitBlake2bAVX512};
+
+// Initialize the hashing object for Blake2s hashing with the current implementation.
+void TwoCats_InitBlake2s(TwoCats_H *H) {
+    initBlake2sFuncs[TwoCats_GetImplementation()](H);
+}
+
+// Initialize the hashing object for Blake2b hashing with the current implementation.
+void TwoCats_InitBlake2b(TwoCats_H *H) {
+    initBlake2bFuncs[TwoCats_GetImplementation()](H);
+}
@@ -0,0 +1,43 @@
+/*
+   TwoCats event reporting, so tools can measure each level and slice of memory hashing.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include "twocats-internal.h"
+
+static TwoCats_EventCallback eventCallback = NULL;
+static void *eventUserData = NULL;
+
+// Set the callback for hashes started after this, or NULL for none.
+void TwoCats_SetEventCallback(TwoCats_EventCallback callback, void *userData) {
+    eventCallback = callback;
+    eventUserData = userData;
+}
+
+// Return the callback, and write its user data to userData if it is not NULL.
+TwoCats_EventCallback TwoCats_GetEventCallback(void **userData) {
+    if(userData != NULL) {
+        *userData = eventUserData;
+    }
+    return eventCallback;
+}
+
+// Return the name of the event type.
+char *TwoCats_GetEventTypeName(TwoCats_EventType type) {
+    switch(type) {
+    case TWOCATS_EVENT_LEVEL_BEGIN: return "level-begin";
+    case TWOCATS_EVENT_LEVEL_END: return "level-end";
+    case TWOCATS_EVENT_SLICE_BEGIN: return "slice-begin";
+    case TWOCATS_EVENT_SLICE_END: return "slice-end";
+    default:;
+    }
+    return NULL;
+}
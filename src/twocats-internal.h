@@ -13,6 +13,12 @@
 
 #include <openssl/sha.h>
 
+// Files compiled once per instruction set get -DTWOCATS_ISA=<name>, where name is one of
+// Generic, SSE2, SSSE3, SSE41, AVX2, or AVX512, and use this to name what they export.
+#define TWOCATS_PASTE(a, b) a ## b
+#define TWOCATS_ISA_NAME2(name, isa) TWOCATS_PASTE(name, isa)
+#define TWOCATS_ISA_NAME(name) TWOCATS_ISA_NAME2(name, TWOCATS_ISA)
+
 #if defined(__AVX2__) || defined(__SSE2__)
 #include "../blake2-sse/blake2.h"
 #else
@@ -23,6 +29,8 @@
 
 #define TWOCATS_SLICES 4
 #define TWOCATS_MINBLOCKS 256
+// Prefaulting writes one byte every TWOCATS_PAGESIZE bytes
+#define TWOCATS_PAGESIZE 4096
 
 // The TwoCats_H wrapper class supports pluggable hash functions.
 
@@ -56,8 +64,177 @@ void TwoCats_InitSHA256(TwoCats_H *H);
 void TwoCats_InitBlake2b(TwoCats_H *H);
 void TwoCats_InitSHA512(TwoCats_H *H);
 
+// Blake2 is compiled for each instruction set, and TwoCats_InitBlake2s/b pick one.
+void TwoCats_InitBlake2sGeneric(TwoCats_H *H);
+void TwoCats_InitBlake2sSSE2(TwoCats_H *H);
+void TwoCats_InitBlake2sSSSE3(TwoCats_H *H);
+void TwoCats_InitBlake2sSSE41(TwoCats_H *H);
+void TwoCats_InitBlake2sAVX2(TwoCats_H *H);
+void TwoCats_InitBlake2sAVX512(TwoCats_H *H);
+void TwoCats_InitBlake2bGeneric(TwoCats_H *H);
+void TwoCats_InitBlake2bSSE2(TwoCats_H *H);
+void TwoCats_InitBlake2bSSSE3(TwoCats_H *H);
+void TwoCats_InitBlake2bSSE41(TwoCats_H *H);
+void TwoCats_InitBlake2bAVX2(TwoCats_H *H);
+void TwoCats_InitBlake2bAVX512(TwoCats_H *H);
+
+// Hash 8 Blake2s states at once, the same as calling H->HashState on each.  With AVX2,
+// this runs the 8 compressions in parallel.
+typedef void (*TwoCats_HashStates8Func)(uint32_t *states[8], const uint32_t values[8]);
+void TwoCats_Blake2sHashStates8Generic(uint32_t *states[8], const uint32_t values[8]);
+void TwoCats_Blake2sHashStates8SSE2(uint32_t *states[8], const uint32_t values[8]);
+void TwoCats_Blake2sHashStates8SSSE3(uint32_t *states[8], const uint32_t values[8]);
+void TwoCats_Blake2sHashStates8SSE41(uint32_t *states[8], const uint32_t values[8]);
+void TwoCats_Blake2sHashStates8AVX2(uint32_t *states[8], const uint32_t values[8]);
+void TwoCats_Blake2sHashStates8AVX512(uint32_t *states[8], const uint32_t values[8]);
+
+// The memory hashing kernel in twocats-kernel.c, also compiled for each instruction set.
+// It hashes the block at prevAddr and the block at fromAddr into toAddr, and returns the
+// multiplication chain result, to be hashed into the state with H->HashState.
+typedef uint32_t (*TwoCats_HashBlocksFunc)(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
+    uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksGeneric(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
+    uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksSSE2(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
+    uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksSSSE3(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
+    uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksSSE41(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
+    uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksAVX2(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
+    uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksAVX512(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
+    uint8_t multiplies, uint8_t lanes);
+
+// The kernel for streaming stores.  It reads the previous block from prevBlock rather than
+// memory, writes the new block to toAddr with stores that bypass the cache, and also
+// writes it to copyBlock, which is normally the previous block for the next call.
+typedef uint32_t (*TwoCats_HashBlocksStreamingFunc)(uint32_t *state, uint32_t *mem,
+    uint32_t blocklen, uint32_t subBlocklen, uint64_t fromAddr, const uint32_t *prevBlock,
+    uint64_t toAddr, uint32_t *copyBlock, uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksStreamingGeneric(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, const uint32_t *prevBlock, uint64_t toAddr,
+    uint32_t *copyBlock, uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksStreamingSSE2(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, const uint32_t *prevBlock, uint64_t toAddr,
+    uint32_t *copyBlock, uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksStreamingSSSE3(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, const uint32_t *prevBlock, uint64_t toAddr,
+    uint32_t *copyBlock, uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksStreamingSSE41(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, const uint32_t *prevBlock, uint64_t toAddr,
+    uint32_t *copyBlock, uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksStreamingAVX2(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, const uint32_t *prevBlock, uint64_t toAddr,
+    uint32_t *copyBlock, uint8_t multiplies, uint8_t lanes);
+uint32_t TwoCats_HashBlocksStreamingAVX512(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+    uint32_t subBlocklen, uint64_t fromAddr, const uint32_t *prevBlock, uint64_t toAddr,
+    uint32_t *copyBlock, uint8_t multiplies, uint8_t lanes);
+
+// Each kernel is specialized for every combination of multiplies, lanes, and common
+// sub-block sizes.  These return the one for the given parameters, so callers can look it
+// up once per level rather than for every block.
+typedef TwoCats_HashBlocksFunc (*TwoCats_FindHashBlocksFunc)(uint32_t subBlocklen,
+    uint8_t multiplies, uint8_t lanes);
+typedef TwoCats_HashBlocksStreamingFunc (*TwoCats_FindHashBlocksStreamingFunc)(
+    uint32_t subBlocklen, uint8_t multiplies, uint8_t lanes);
+TwoCats_HashBlocksFunc TwoCats_FindHashBlocksGeneric(uint32_t subBlocklen, uint8_t multiplies,
+    uint8_t lanes);
+TwoCats_HashBlocksFunc TwoCats_FindHashBlocksSSE2(uint32_t subBlocklen, uint8_t multiplies,
+    uint8_t lanes);
+TwoCats_HashBlocksFunc TwoCats_FindHashBlocksSSSE3(uint32_t subBlocklen, uint8_t multiplies,
+    uint8_t lanes);
+TwoCats_HashBlocksFunc TwoCats_FindHashBlocksSSE41(uint32_t subBlocklen, uint8_t multiplies,
+    uint8_t lanes);
+TwoCats_HashBlocksFunc TwoCats_FindHashBlocksAVX2(uint32_t subBlocklen, uint8_t multiplies,
+    uint8_t lanes);
+TwoCats_HashBlocksFunc TwoCats_FindHashBlocksAVX512(uint32_t subBlocklen, uint8_t multiplies,
+    uint8_t lanes);
+TwoCats_HashBlocksStreamingFunc TwoCats_FindHashBlocksStreamingGeneric(uint32_t subBlocklen,
+    uint8_t multiplies, uint8_t lanes);
+TwoCats_HashBlocksStreamingFunc TwoCats_FindHashBlocksStreamingSSE2(uint32_t subBlocklen,
+    uint8_t multiplies, uint8_t lanes);
+TwoCats_HashBlocksStreamingFunc TwoCats_FindHashBlocksStreamingSSSE3(uint32_t subBlocklen,
+    uint8_t multiplies, uint8_t lanes);
+TwoCats_HashBlocksStreamingFunc TwoCats_FindHashBlocksStreamingSSE41(uint32_t subBlocklen,
+    uint8_t multiplies, uint8_t lanes);
+TwoCats_HashBlocksStreamingFunc TwoCats_FindHashBlocksStreamingAVX2(uint32_t subBlocklen,
+    uint8_t multiplies, uint8_t lanes);
+TwoCats_HashBlocksStreamingFunc TwoCats_FindHashBlocksStreamingAVX512(uint32_t subBlocklen,
+    uint8_t multiplies, uint8_t lanes);
+
+// Return true if memory hashing of memSize bytes should use streaming stores.
+bool TwoCats_UseStreamingStores(uint64_t memSize);
+
+// Return true if $TWOCATS_PROFILE names a tuning profile that could not be loaded.
+bool TwoCats_ProfileFailed(void);
+
 void TwoCats_InitHash(TwoCats_H *H, TwoCats_HashType type);
 
+// Return this thread's statistics, which TwoCats_GetStats adds up.
+TwoCats_Stats *TwoCats_GetThreadStats(void);
+// Return a monotonic time in nanoseconds.
+uint64_t TwoCats_GetNanoseconds(void);
+
+// The spans of hashing that tracing records.
+typedef enum {
+    TWOCATS_TRACE_ALLOCATE,
+    TWOCATS_TRACE_HASHMEMORY,
+    TWOCATS_TRACE_RESISTANT,
+    TWOCATS_TRACE_PASSWORD,
+    TWOCATS_TRACE_FINALHASH,
+    TWOCATS_TRACE_NONE
+} TwoCats_TraceType;
+
+// True between TwoCats_StartTrace and TwoCats_StopTrace.
+extern bool TwoCats_TraceOn;
+void TwoCats_RecordTrace(TwoCats_TraceType type, uint64_t start, uint64_t end,
+    uint8_t memCost, uint8_t slice, uint8_t thread);
+
+// Record a span of hashing, if tracing is on.  Otherwise this is just a load and a
+// branch.  The slice and thread are only used for slices.
+static inline void TwoCats_Trace(TwoCats_TraceType type, uint64_t start, uint64_t end,
+        uint8_t memCost, uint8_t slice, uint8_t thread) {
+    if(__atomic_load_n(&TwoCats_TraceOn, __ATOMIC_RELAXED)) {
+        TwoCats_RecordTrace(type, start, end, memCost, slice, thread);
+    }
+}
+
+// Static probes in the twocats provider, for attaching bpftrace, perf or SystemTap to a
+// running process.  Build with -DTWOCATS_USDT to include them.  Each probe is a single nop
+// until a tracer enables it.  Without TWOCATS_USDT they compile to nothing.  The probes
+// are, with thread being the logical thread, 0 to parallelism-1:
+//   hash__start(stopMemCost, lanes, parallelism, startMemCost)
+//   hash__done(stopMemCost, lanes, parallelism, startMemCost, succeeded)
+//   alloc__start(stopMemCost, lanes, parallelism, bytes)
+//   alloc__done(stopMemCost, lanes, parallelism, bytes)
+//   level__start(memCost, lanes, parallelism, resistantSlices)
+//   level__done(memCost, lanes, parallelism, resistantSlices)
+//   slice__start(memCost, lanes, parallelism, thread, slice)
+//   slice__done(memCost, lanes, parallelism, thread, slice)
+#ifdef TWOCATS_USDT
+#include <sys/sdt.h>
+#define TWOCATS_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(twocats, name, a1, a2, a3, a4)
+#define TWOCATS_PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5(twocats, name, a1, a2, a3, a4, a5)
+#else
+#define TWOCATS_PROBE4(name, a1, a2, a3, a4) ((void)0)
+#define TWOCATS_PROBE5(name, a1, a2, a3, a4, a5) ((void)0)
+#endif
+
+// Add to one of this thread's statistics.  Only this thread writes them, so a relaxed
+// load and store is enough, and cheaper than an atomic add.
+static inline void TwoCats_AddStat(uint64_t *stat, uint64_t value) {
+    __atomic_store_n(stat, __atomic_load_n(stat, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
 // Encode a length len/4 vector of (uint32_t) into a length len vector of
 // (unsigned char) in little-endian form.  Assumes len is a multiple of 4.
 static inline void encodeLittleEndian(uint8_t *dst, const uint32_t *src, uint32_t len) {
@@ -94,5 +271,13 @@ static inline void secureZeroMemory(void *v, uint32_t n) {
 bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
     uint8_t stopMemCost, uint8_t multiplies, uint8_t lanes, uint8_t parallelism,
     uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost, bool sideChannelResistant);
+// Run TwoCats on numHashes independent hashes with the same parameters.  The optimized
+// version hashes them in lock-step.
+bool TwoCats_Batch(TwoCats_H *H, uint32_t **hash32s, uint32_t numHashes, uint8_t startMemCost,
+    uint8_t stopMemCost, uint8_t multiplies, uint8_t lanes, uint8_t parallelism,
+    uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost, bool sideChannelResistant);
+// Write to every page of memory so it is faulted in before hashing.  The optimized
+// version splits this across parallelism threads.
+bool TwoCats_PrefaultMemory(void *memory, uint64_t size, uint8_t parallelism);
 void TwoCats_PrintState(char *message, uint32_t *state, uint32_t length);
 void TwoCats_DumpMemory(char *fileName, uint32_t *mem, uint64_t memlen);
@@ -0,0 +1,593 @@
+/*
+   TwoCats memory hashing kernel
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// This file is compiled once per instruction set with -DTWOCATS_ISA=<name> and the
+// matching -m flags, and twocats-opt.c picks one at run time.  See the Makefile.
+
+#include "twocats-internal.h"
+
+// The generic kernel is built with -DTWOCATS_NO_SIMD and uses none of this.
+#ifndef TWOCATS_NO_SIMD
+
+// This include code copied from blake2s.c
+#ifdef __AVX2__
+#define HAVE_AVX2
+#endif
+#ifdef __AVX512F__
+#define HAVE_AVX512F
+#endif
+#ifdef __AVX512VL__
+#define HAVE_AVX512VL
+#endif
+#include "../blake2-sse/blake2-config.h"
+
+#include <emmintrin.h>
+#if defined(HAVE_SSSE3)
+#include <tmmintrin.h>
+#endif
+#if defined(HAVE_SSE41)
+#include <smmintrin.h>
+#endif
+#if defined(HAVE_AVX)
+#include <immintrin.h>
+#endif
+#if defined(HAVE_XOP)
+#include <x86intrin.h>
+#endif
+
+// This rotate code is motivated from blake2s-round.h.  AVX-512VL has a real rotate (vprold).
+#if defined(HAVE_AVX512VL)
+#define DECLARE_ROTATE256_CONSTS
+#define ROTATE_LEFT8_256(s) _mm256_rol_epi32(s, 8)
+#elif defined(HAVE_AVX2)
+#define DECLARE_ROTATE256_CONSTS \
+    __m256i shuffleVal = _mm256_set_epi8(30, 29, 28, 31, 26, 25, 24, 27, 22, 21, 20, 23, 18, 17, 16, 19, \
+        14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+#define ROTATE_LEFT8_256(s) _mm256_shuffle_epi8(s, shuffleVal)
+#endif
+
+#if defined(HAVE_AVX512VL)
+#define DECLARE_ROTATE128_CONSTS
+#define ROTATE_LEFT8_128(s) _mm_rol_epi32(s, 8)
+#elif !defined(HAVE_XOP)
+#ifdef HAVE_SSSE3
+#define DECLARE_ROTATE128_CONSTS \
+    __m128i shuffleVal = _mm_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+#define ROTATE_LEFT8_128(s) _mm_shuffle_epi8(s, shuffleVal)
+#else
+#define DECLARE_ROTATE128_CONSTS
+#define ROTATE_LEFT8_128(s) _mm_or_si128(_mm_srli_epi32(s, 24), _mm_slli_epi32(s, 8))
+#endif
+#endif
+
+// Write a vector to the to-block.  When streaming, the store bypasses the cache, and we
+// keep a cached copy for hashing the next block.
+#define STORE(streamFunc, t, copy, v) \
+    do { \
+        if(stream) { \
+            streamFunc(t++, v); \
+            *copy++ = v; \
+        } else { \
+            *t++ = v; \
+        } \
+    } while(0)
+// The scalar code streams a uint32_t at a time.
+#define STREAM32(t, v) _mm_stream_si32((int *)(t), (int)(v))
+
+#else
+
+#define STREAM32(t, v) (*(t) = (v))
+
+#endif // TWOCATS_NO_SIMD
+
+#if defined(HAVE_AVX2)
+static void convStateFromUint32ToM256i(uint32_t state[8], __m256i *v) {
+    *v = _mm256_loadu_si256((__m256i *)state);
+}
+
+// Convert a __m256i to uint32_t[8].  Reading the vector through a uint32_t pointer breaks
+// strict aliasing, which gcc miscompiles at -O2 and above.
+static void convStateFromM256iToUint32(__m256i *v, uint32_t state[8]) {
+    _mm256_storeu_si256((__m256i *)state, *v);
+}
+#endif
+#if defined(HAVE_SSE2)
+// Convert a uint32_t[8] to two __m128i values. len must be 4 or 8.
+static void convStateFromUint32ToM128i(uint32_t state[8], __m128i *v1, __m128i *v2, uint8_t len) {
+    *v1 = _mm_loadu_si128((__m128i *)state);
+    if(len == 8) {
+        *v2 = _mm_loadu_si128((__m128i *)(state + 4));
+    }
+}
+
+// Convert two __m128i to uint32_t*. len must be 4 or 8.
+static void convStateFromM128iToUint32(__m128i *v1, __m128i *v2, uint32_t *state, uint8_t len) {
+    _mm_storeu_si128((__m128i *)state, *v1);
+    if(len == 8) {
+        _mm_storeu_si128((__m128i *)(state + 4), *v2);
+    }
+}
+#endif
+
+// The address of the next sub-block we read from the previous block depends on the first
+// word of the next from sub-block, which we can read a sub-block early.  Prefetch it so
+// the load overlaps hashing the current sub-block.  The previous block was just written,
+// so it is usually still in L1 or L2 cache, and this has not measured faster, so it is
+// only done when built with -DTWOCATS_PREFETCH.
+static inline void prefetchNextSubBlock(const uint32_t *prevBlock, const uint32_t *f,
+        uint32_t subBlocklen, uint32_t numSubBlocks, uint32_t i) {
+#ifdef TWOCATS_PREFETCH
+    if(i + 1 < numSubBlocks) {
+        uint32_t nextRandVal = f[subBlocklen];
+        const uint32_t *nextP = prevBlock + subBlocklen*(nextRandVal & (numSubBlocks - 1));
+        // One prefetch per 64 byte cache line.  The hardware prefetcher picks up the
+        // rest of a long sub-block once we start reading it.
+        uint32_t prefetchLen = subBlocklen < 64? subBlocklen : 64;
+        for(uint32_t j = 0; j < prefetchLen; j += 16) {
+            __builtin_prefetch(nextP + j, 0, 3);
+        }
+    }
+#endif
+}
+
+/* Hash three blocks together with fast SSE friendly hash function optimized for high memory bandwidth.
+   Basically, it does for every 8 words:
+       for(i = 0; i < 8; i++) {
+           state[i] = ROTATE_LEFT((state[i] + *p++) ^ *f++, 8);
+           *t++ = state[i];
+  
+   Return the result of the multiplication chain, which the caller hashes into the state
+   with H->HashState.
+
+   TODO: Optimizations for ARM, and widths other than 8 should be written as well. */
+       
+static inline __attribute__((always_inline)) uint32_t hashBlocksInner(uint32_t *state, uint32_t *mem,
+        const uint32_t *prevBlock, uint32_t *copyBlock, uint32_t blocklen,
+        uint32_t subBlocklen, uint64_t fromAddr, uint64_t toAddr, uint8_t multiplies,
+        uint8_t lanes, bool stream) {
+
+    // Do SIMD friendly memory hashing and a scalar CPU friendly parallel multiplication chain
+    uint32_t numSubBlocks = blocklen/subBlocklen;
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+
+    bool haveFastCode = false;
+    if(lanes == 8) {
+#if defined(HAVE_AVX2)
+        haveFastCode = true;
+        __m256i s;
+        convStateFromUint32ToM256i(state, &s);
+        __m256i *m = (__m256i *)mem;
+        DECLARE_ROTATE256_CONSTS
+        __m256i *f;
+        __m256i *t;
+        __m256i *p;
+        f = m + fromAddr/8;
+        t = m + toAddr/8;
+        __m256i *copy = (__m256i *)copyBlock;
+        for(uint32_t i = 0; i < numSubBlocks; i++) {
+            uint32_t randVal = *(uint32_t *)f;
+            p = (__m256i *)prevBlock + (subBlocklen/8)*(randVal & (numSubBlocks - 1));
+            prefetchNextSubBlock(prevBlock, (uint32_t *)f, subBlocklen, numSubBlocks, i);
+            for(uint32_t j = 0; j < subBlocklen/8; j++) {
+
+                // Compute the multiplication chain
+                for(uint8_t k = 0; k < multiplies; k++) {
+                    a ^= (uint64_t)b*c >> 32;
+                    b += c;
+                    c ^= (uint64_t)a*d >> 32;
+                    d += a;
+                }
+
+                // Hash 32 bytes of memory
+                s = _mm256_add_epi32(s, *p++);
+                s = _mm256_xor_si256(s, *f++);
+                s = ROTATE_LEFT8_256(s);
+                STORE(_mm256_stream_si256, t, copy, s);
+            }
+        }
+        convStateFromM256iToUint32(&s, state);
+#elif defined(HAVE_SSE2)
+        haveFastCode = true;
+        __m128i s1;
+        __m128i s2;
+        convStateFromUint32ToM128i(state, &s1, &s2, 8);
+        __m128i *m = (__m128i *)mem;
+        DECLARE_ROTATE128_CONSTS
+        __m128i *f;
+        __m128i *t;
+        __m128i *p;
+        f = m + fromAddr/4;
+        t = m + toAddr/4;
+        __m128i *copy = (__m128i *)copyBlock;
+        for(uint32_t i = 0; i < numSubBlocks; i++) {
+            uint32_t randVal = *(uint32_t *)f;
+            p = (__m128i *)prevBlock + (subBlocklen/4)*(randVal & (numSubBlocks - 1));
+            prefetchNextSubBlock(prevBlock, (uint32_t *)f, subBlocklen, numSubBlocks, i);
+            for(uint32_t j = 0; j < subBlocklen/8; j++) {
+
+                // Compute the multiplication chain
+                for(uint8_t k = 0; k < multiplies; k++) {
+                    a ^= (uint64_t)b*c >> 32;
+                    b += c;
+                    c ^= (uint64_t)a*d >> 32;
+                    d += a;
+                }
+
+                // Hash 32 bytes of memory
+                s1 = _mm_add_epi32(s1, *p++);
+                s1 = _mm_xor_si128(s1, *f++);
+                // Rotate left 8
+                s1 = ROTATE_LEFT8_128(s1);
+                STORE(_mm_stream_si128, t, copy, s1);
+                s2 = _mm_add_epi32(s2, *p++);
+                s2 = _mm_xor_si128(s2, *f++);
+                // Rotate left 8
+                s2 = ROTATE_LEFT8_128(s2);
+                STORE(_mm_stream_si128, t, copy, s2);
+            }
+        }
+        convStateFromM128iToUint32(&s1, &s2, state, 8);
+#endif
+    } else if(lanes == 4) {
+#if defined(HAVE_SSE2)
+        haveFastCode = true;
+        __m128i s;
+        convStateFromUint32ToM128i(state, &s, &s, 4);
+        __m128i *m = (__m128i *)mem;
+        DECLARE_ROTATE128_CONSTS
+        __m128i *f;
+        __m128i *t;
+        __m128i *p;
+        f = m + fromAddr/4;
+        t = m + toAddr/4;
+        __m128i *copy = (__m128i *)copyBlock;
+        for(uint32_t i = 0; i < numSubBlocks; i++) {
+            uint32_t randVal = *(uint32_t *)f;
+            p = (__m128i *)prevBlock + (subBlocklen/4)*(randVal & (numSubBlocks - 1));
+            prefetchNextSubBlock(prevBlock, (uint32_t *)f, subBlocklen, numSubBlocks, i);
+            for(uint32_t j = 0; j < subBlocklen/4; j++) {
+
+                // Compute the multiplication chain
+                for(uint8_t k = 0; k < multiplies; k++) {
+                    a ^= (uint64_t)b*c >> 32;
+                    b += c;
+                    c ^= (uint64_t)a*d >> 32;
+                    d += a;
+                }
+
+                // Hash 16 bytes of memory
+                s = _mm_add_epi32(s, *p++);
+                s = _mm_xor_si128(s, *f++);
+                // Rotate left 8
+                s = ROTATE_LEFT8_128(s);
+                STORE(_mm_stream_si128, t, copy, s);
+            }
+        }
+        convStateFromM128iToUint32(&s, &s, state, 4);
+#endif
+    } else if(lanes == 16) {
+#if defined(HAVE_AVX512F)
+        haveFastCode = true;
+        __m512i s = _mm512_loadu_si512((void *)state);
+        __m512i *m = (__m512i *)mem;
+        __m512i *f;
+        __m512i *t;
+        __m512i *p;
+        f = m + fromAddr/16;
+        t = m + toAddr/16;
+        __m512i *copy = (__m512i *)copyBlock;
+        for(uint32_t i = 0; i < numSubBlocks; i++) {
+            uint32_t randVal = *(uint32_t *)f;
+            p = (__m512i *)prevBlock + (subBlocklen/16)*(randVal & (numSubBlocks - 1));
+            prefetchNextSubBlock(prevBlock, (uint32_t *)f, subBlocklen, numSubBlocks, i);
+            for(uint32_t j = 0; j < subBlocklen/16; j++) {
+
+                // Compute the multiplication chain
+                for(uint8_t k = 0; k < multiplies; k++) {
+                    a ^= (uint64_t)b*c >> 32;
+                    b += c;
+                    c ^= (uint64_t)a*d >> 32;
+                    d += a;
+                }
+
+                // Hash 64 bytes of memory
+                s = _mm512_add_epi32(s, *p++);
+                s = _mm512_xor_si512(s, *f++);
+                s = _mm512_rol_epi32(s, 8);
+                STORE(_mm512_stream_si512, t, copy, s);
+            }
+        }
+        _mm512_storeu_si512((void *)state, s);
+#elif defined(HAVE_AVX2)
+        haveFastCode = true;
+        __m256i s1 = _mm256_loadu_si256((__m256i *)state);
+        __m256i s2 = _mm256_loadu_si256((__m256i *)(state + 8));
+        __m256i *m = (__m256i *)mem;
+        DECLARE_ROTATE256_CONSTS
+        __m256i *f;
+        __m256i *t;
+        __m256i *p;
+        f = m + fromAddr/8;
+        t = m + toAddr/8;
+        __m256i *copy = (__m256i *)copyBlock;
+        for(uint32_t i = 0; i < numSubBlocks; i++) {
+            uint32_t randVal = *(uint32_t *)f;
+            p = (__m256i *)prevBlock + (subBlocklen/8)*(randVal & (numSubBlocks - 1));
+            prefetchNextSubBlock(prevBlock, (uint32_t *)f, subBlocklen, numSubBlocks, i);
+            for(uint32_t j = 0; j < subBlocklen/16; j++) {
+
+                // Compute the multiplication chain
+                for(uint8_t k = 0; k < multiplies; k++) {
+                    a ^= (uint64_t)b*c >> 32;
+                    b += c;
+                    c ^= (uint64_t)a*d >> 32;
+                    d += a;
+                }
+
+                // Hash 64 bytes of memory
+                s1 = _mm256_add_epi32(s1, *p++);
+                s1 = _mm256_xor_si256(s1, *f++);
+                s1 = ROTATE_LEFT8_256(s1);
+                STORE(_mm256_stream_si256, t, copy, s1);
+                s2 = _mm256_add_epi32(s2, *p++);
+                s2 = _mm256_xor_si256(s2, *f++);
+                s2 = ROTATE_LEFT8_256(s2);
+                STORE(_mm256_stream_si256, t, copy, s2);
+            }
+        }
+        _mm256_storeu_si256((__m256i *)state, s1);
+        _mm256_storeu_si256((__m256i *)(state + 8), s2);
+#endif
+    } else if(lanes == 2) {
+        // Keep both lanes in registers.  Packing them in a uint64_t and doing SWAR adds
+        // and rotates was half as fast as this on x86-64.
+        haveFastCode = true;
+        uint32_t s0 = state[0];
+        uint32_t s1 = state[1];
+        uint32_t *f = mem + fromAddr;
+        uint32_t *t = mem + toAddr;
+        uint32_t *copy = copyBlock;
+        for(uint32_t i = 0; i < numSubBlocks; i++) {
+            uint32_t randVal = *f;
+            const uint32_t *p = prevBlock + subBlocklen*(randVal & (numSubBlocks - 1));
+            prefetchNextSubBlock(prevBlock, f, subBlocklen, numSubBlocks, i);
+            for(uint32_t j = 0; j < subBlocklen/2; j++) {
+
+                // Compute the multiplication chain
+                for(uint8_t k = 0; k < multiplies; k++) {
+                    a ^= (uint64_t)b*c >> 32;
+                    b += c;
+                    c ^= (uint64_t)a*d >> 32;
+                    d += a;
+                }
+
+                // Hash 8 bytes of memory
+                s0 = (s0 + p[0]) ^ f[0];
+                s0 = (s0 >> 24) | (s0 << 8);
+                s1 = (s1 + p[1]) ^ f[1];
+                s1 = (s1 >> 24) | (s1 << 8);
+                p += 2;
+                f += 2;
+                if(stream) {
+                    STREAM32(t, s0);
+                    STREAM32(t + 1, s1);
+                    copy[0] = s0;
+                    copy[1] = s1;
+                    copy += 2;
+                } else {
+                    t[0] = s0;
+                    t[1] = s1;
+                }
+                t += 2;
+            }
+        }
+        state[0] = s0;
+        state[1] = s1;
+    } else if(lanes == 1) {
+        // Keep the lane in a register.  Otherwise, the compiler has to assume writing to
+        // memory might change the state, and loads and stores it for every word.
+        haveFastCode = true;
+        uint32_t s = state[0];
+        uint32_t *f = mem + fromAddr;
+        uint32_t *t = mem + toAddr;
+        uint32_t *copy = copyBlock;
+        for(uint32_t i = 0; i < numSubBlocks; i++) {
+            uint32_t randVal = *f;
+            const uint32_t *p = prevBlock + subBlocklen*(randVal & (numSubBlocks - 1));
+            prefetchNextSubBlock(prevBlock, f, subBlocklen, numSubBlocks, i);
+            for(uint32_t j = 0; j < subBlocklen; j++) {
+
+                // Compute the multiplication chain
+                for(uint8_t k = 0; k < multiplies; k++) {
+                    a ^= (uint64_t)b*c >> 32;
+                    b += c;
+                    c ^= (uint64_t)a*d >> 32;
+                    d += a;
+                }
+
+                // Hash 4 bytes of memory
+                s = (s + *p++) ^ *f++;
+                s = (s >> 24) | (s << 8);
+                if(stream) {
+                    STREAM32(t++, s);
+                    *copy++ = s;
+                } else {
+                    *t++ = s;
+                }
+            }
+        }
+        state[0] = s;
+    }
+    if(!haveFastCode) {
+        uint32_t *f = mem + fromAddr;
+        uint32_t *t = mem + toAddr;
+        uint32_t *copy = copyBlock;
+        for(uint32_t i = 0; i < numSubBlocks; i++) {
+            uint32_t randVal = *f;
+            const uint32_t *p = prevBlock + subBlocklen*(randVal & (numSubBlocks - 1));
+            prefetchNextSubBlock(prevBlock, f, subBlocklen, numSubBlocks, i);
+            for(uint32_t j = 0; j < subBlocklen/lanes; j++) {
+
+                // Compute the multiplication chain
+                for(uint32_t k = 0; k < multiplies; k++) {
+                    a ^= (uint64_t)b*c >> 32;
+                    b += c;
+                    c ^= (uint64_t)a*d >> 32;
+                    d += a;
+                }
+
+                // Hash lanes of memory
+                for(uint32_t k = 0; k < lanes; k++) {
+                    state[k] = (state[k] + *p++) ^ *f++;
+                    state[k] = (state[k] >> 24) | (state[k] << 8);
+                    if(stream) {
+                        STREAM32(t++, state[k]);
+                        *copy++ = state[k];
+                    } else {
+                        *t++ = state[k];
+                    }
+                }
+            }
+        }
+    }
+#ifndef TWOCATS_NO_SIMD
+    if(stream) {
+        // Make our streaming stores visible before other threads are told the block is done
+        _mm_sfence();
+    }
+#endif
+    return a;
+}
+
+// Rather than hoping the optimizer clones hashBlocksInner through a cascade of switches,
+// we define a kernel for each combination of multiplies, lanes, and subBlocklen, with
+// those as constants, so each is fully unrolled and has no dead branches.  Sub-blocks from
+// 8 to 256 words get their own kernels, and other sizes, including whole blocks in the
+// side-channel resistant slices, share one with a variable subBlocklen.
+#define DEFINE_KERNELS(multiplies, lanes, name, subBlocklenValue) \
+    static uint32_t hashBlocks_##multiplies##_##lanes##_##name(uint32_t *state, uint32_t *mem, \
+            uint32_t blocklen, uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, \
+            uint64_t toAddr, uint8_t unusedMultiplies, uint8_t unusedLanes) { \
+        return hashBlocksInner(state, mem, mem + prevAddr, NULL, blocklen, subBlocklenValue, \
+            fromAddr, toAddr, multiplies, lanes, false); \
+    } \
+    static uint32_t hashBlocksStreaming_##multiplies##_##lanes##_##name(uint32_t *state, \
+            uint32_t *mem, uint32_t blocklen, uint32_t subBlocklen, uint64_t fromAddr, \
+            const uint32_t *prevBlock, uint64_t toAddr, uint32_t *copyBlock, \
+            uint8_t unusedMultiplies, uint8_t unusedLanes) { \
+        return hashBlocksInner(state, mem, prevBlock, copyBlock, blocklen, subBlocklenValue, \
+            fromAddr, toAddr, multiplies, lanes, true); \
+    }
+#define KERNEL_NAME(multiplies, lanes, name, subBlocklenValue) \
+    hashBlocks_##multiplies##_##lanes##_##name,
+#define STREAMING_KERNEL_NAME(multiplies, lanes, name, subBlocklenValue) \
+    hashBlocksStreaming_##multiplies##_##lanes##_##name,
+
+// Apply macro to each sub-block size, with the variable one last.
+#define FOR_SUBBLOCKLENS(macro, multiplies, lanes) \
+    macro(multiplies, lanes, 8, 8) \
+    macro(multiplies, lanes, 16, 16) \
+    macro(multiplies, lanes, 32, 32) \
+    macro(multiplies, lanes, 64, 64) \
+    macro(multiplies, lanes, 128, 128) \
+    macro(multiplies, lanes, 256, 256) \
+    macro(multiplies, lanes, Any, subBlocklen)
+#define TWOCATS_NUMSUBBLOCKLENS 7
+
+// Lanes are a power of 2 from 1 to 16.
+#define FOR_LANES(macro, multiplies) \
+    {FOR_SUBBLOCKLENS(macro, multiplies, 1)}, \
+    {FOR_SUBBLOCKLENS(macro, multiplies, 2)}, \
+    {FOR_SUBBLOCKLENS(macro, multiplies, 4)}, \
+    {FOR_SUBBLOCKLENS(macro, multiplies, 8)}, \
+    {FOR_SUBBLOCKLENS(macro, multiplies, 16)}
+#define TWOCATS_NUMLANES 5
+
+// Multiplies are from 0 to 8.
+#define FOR_MULTIPLIES(macro) \
+    {FOR_LANES(macro, 0)}, {FOR_LANES(macro, 1)}, {FOR_LANES(macro, 2)}, \
+    {FOR_LANES(macro, 3)}, {FOR_LANES(macro, 4)}, {FOR_LANES(macro, 5)}, \
+    {FOR_LANES(macro, 6)}, {FOR_LANES(macro, 7)}, {FOR_LANES(macro, 8)}
+#define TWOCATS_NUMMULTIPLIES 9
+
+// Defining functions doesn't want the braces and commas of a table, so this just lists
+// every combination.
+#define DEFINE_LANES(multiplies) \
+    FOR_SUBBLOCKLENS(DEFINE_KERNELS, multiplies, 1) \
+    FOR_SUBBLOCKLENS(DEFINE_KERNELS, multiplies, 2) \
+    FOR_SUBBLOCKLENS(DEFINE_KERNELS, multiplies, 4) \
+    FOR_SUBBLOCKLENS(DEFINE_KERNELS, multiplies, 8) \
+    FOR_SUBBLOCKLENS(DEFINE_KERNELS, multiplies, 16)
+DEFINE_LANES(0)
+DEFINE_LANES(1)
+DEFINE_LANES(2)
+DEFINE_LANES(3)
+DEFINE_LANES(4)
+DEFINE_LANES(5)
+DEFINE_LANES(6)
+DEFINE_LANES(7)
+DEFINE_LANES(8)
+
+static const TwoCats_HashBlocksFunc kernels[TWOCATS_NUMMULTIPLIES][TWOCATS_NUMLANES]
+        [TWOCATS_NUMSUBBLOCKLENS] = {FOR_MULTIPLIES(KERNEL_NAME)};
+static const TwoCats_HashBlocksStreamingFunc streamingKernels[TWOCATS_NUMMULTIPLIES]
+        [TWOCATS_NUMLANES][TWOCATS_NUMSUBBLOCKLENS] = {FOR_MULTIPLIES(STREAMING_KERNEL_NAME)};
+
+// Return log2 of a power of 2.
+static inline uint32_t log2PowerOf2(uint32_t x) {
+    return __builtin_ctz(x);
+}
+
+// Find the table index for subBlocklen, which is the last one if it has no kernel of its own.
+static inline uint32_t subBlocklenIndex(uint32_t subBlocklen) {
+    if(subBlocklen < 8 || subBlocklen > 256 || (subBlocklen & (subBlocklen - 1)) != 0) {
+        return TWOCATS_NUMSUBBLOCKLENS - 1;
+    }
+    return log2PowerOf2(subBlocklen) - 3;
+}
+
+// Return the kernel specialized for these parameters, which must already be verified: lanes
+// is a power of 2 from 1 to 16, and multiplies is at most 8.  Look this up once, rather
+// than for every block.
+TwoCats_HashBlocksFunc TWOCATS_ISA_NAME(TwoCats_FindHashBlocks)(uint32_t subBlocklen,
+        uint8_t multiplies, uint8_t lanes) {
+    return kernels[multiplies][log2PowerOf2(lanes)][subBlocklenIndex(subBlocklen)];
+}
+
+// The same, for the streaming store kernel.
+TwoCats_HashBlocksStreamingFunc TWOCATS_ISA_NAME(TwoCats_FindHashBlocksStreaming)(
+        uint32_t subBlocklen, uint8_t multiplies, uint8_t lanes) {
+    return streamingKernels[multiplies][log2PowerOf2(lanes)][subBlocklenIndex(subBlocklen)];
+}
+
+// This is the entry point for this instruction set's kernel, for callers that don't keep
+// the kernel from TwoCats_FindHashBlocks.
+uint32_t TWOCATS_ISA_NAME(TwoCats_HashBlocks)(uint32_t *state, uint32_t *mem, uint32_t blocklen,
+        uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
+        uint8_t multiplies, uint8_t lanes) {
+    return TWOCATS_ISA_NAME(TwoCats_FindHashBlocks)(subBlocklen, multiplies, lanes)(state,
+        mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, multiplies, lanes);
+}
+
+// The same, but read the previous block from prevBlock, and write the new block to memory
+// with streaming stores, and to copyBlock with normal ones.
+uint32_t TWOCATS_ISA_NAME(TwoCats_HashBlocksStreaming)(uint32_t *state, uint32_t *mem,
+        uint32_t blocklen, uint32_t subBlocklen, uint64_t fromAddr, const uint32_t *prevBlock,
+        uint64_t toAddr, uint32_t *copyBlock, uint8_t multiplies, uint8_t lanes) {
+    return TWOCATS_ISA_NAME(TwoCats_FindHashBlocksStreaming)(subBlocklen, multiplies,
+        lanes)(state, mem, blocklen, subBlocklen, fromAddr, prevBlock, toAddr, copyBlock,
+        multiplies, lanes);
+}
@@ -0,0 +1,208 @@
+/*
+   TwoCats memory allocation, with huge page support.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// Needed for MAP_ANONYMOUS, MAP_HUGETLB and madvise with -std=c99
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include "twocats-internal.h"
+
+#define TWOCATS_HUGE2M ((uint64_t)1 << 21)
+#define TWOCATS_HUGE1G ((uint64_t)1 << 30)
+
+// Older headers don't have the MAP_HUGETLB page size flags, but the kernel does.
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_SHIFT 26
+#endif
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_2MB)
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_1GB)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// Return the name of the page mode.
+char *TwoCats_GetPageModeName(TwoCats_PageMode pageMode) {
+    switch(pageMode) {
+    case TWOCATS_PAGES_DEFAULT: return "default";
+    case TWOCATS_PAGES_TRANSPARENT: return "transparent";
+    case TWOCATS_PAGES_HUGE2M: return "2m";
+    case TWOCATS_PAGES_HUGE1G: return "1g";
+    default:;
+    }
+    return NULL;
+}
+
+// Find a page mode with the given name.
+TwoCats_PageMode TwoCats_FindPageMode(char *name) {
+    for(TwoCats_PageMode pageMode = 0; pageMode < TWOCATS_PAGES_NONE; pageMode++) {
+        if(!strcasecmp(TwoCats_GetPageModeName(pageMode), name)) {
+            return pageMode;
+        }
+    }
+    return TWOCATS_PAGES_NONE;
+}
+
+// Return the size actually mapped for 2^memCost KiB in this page mode.
+static uint64_t mappedSize(uint8_t memCost, TwoCats_PageMode pageMode) {
+    uint64_t size = (uint64_t)1024 << memCost;
+    uint64_t pageSize = pageMode == TWOCATS_PAGES_HUGE1G? TWOCATS_HUGE1G : TWOCATS_HUGE2M;
+    if(pageMode == TWOCATS_PAGES_DEFAULT) {
+        return size;
+    }
+    return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+#if defined(MAP_HUGETLB)
+// Map memory from the kernel's huge page pool.  This fails unless the administrator
+// has reserved enough huge pages of this size, for example in /proc/sys/vm/nr_hugepages.
+static void *mapHugePages(uint64_t size, int sizeFlag) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1, 0);
+    return mem == MAP_FAILED? NULL : mem;
+}
+#endif
+
+#if defined(MADV_HUGEPAGE)
+// Return false if the administrator has turned transparent huge pages off.  madvise
+// still succeeds then, but we would never get a huge page.
+static bool transparentHugePagesEnabled(void) {
+    FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if(file == NULL) {
+        return true; // Let anonHugePageBytes decide
+    }
+    char line[128];
+    bool enabled = fgets(line, sizeof(line), file) != NULL && strstr(line, "[never]") == NULL;
+    fclose(file);
+    return enabled;
+}
+
+// Return how many bytes of the mapping containing mem are in transparent huge pages,
+// from AnonHugePages in /proc/self/smaps, or 0 if we can't tell.
+static uint64_t anonHugePageBytes(void *mem) {
+    FILE *file = fopen("/proc/self/smaps", "r");
+    if(file == NULL) {
+        return 0;
+    }
+    uint64_t bytes = 0;
+    bool inMapping = false;
+    char line[512];
+    while(fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long start, end, kiB;
+        if(sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+            if(inMapping) {
+                break;
+            }
+            inMapping = start <= (uintptr_t)mem && (uintptr_t)mem < end;
+        } else if(inMapping && sscanf(line, "AnonHugePages: %llu kB", &kiB) == 1) {
+            bytes = (uint64_t)kiB*1024;
+        }
+    }
+    fclose(file);
+    return bytes;
+}
+
+// Map 2 MiB aligned memory and ask the kernel to back it with transparent huge pages.
+// The kernel only uses huge pages for aligned 2 MiB ranges, so we map an extra 2 MiB
+// and trim the ends.  madvise succeeds even when the kernel won't give us huge pages,
+// so fault in the first 2 MiB and check that it got one, or return NULL.  The rest is
+// left for the caller to fault in, so it can be spread across NUMA nodes.
+static void *mapTransparentHugePages(uint64_t size) {
+    if(!transparentHugePagesEnabled()) {
+        return NULL;
+    }
+    uint8_t *mem = mmap(NULL, size + TWOCATS_HUGE2M, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+        return NULL;
+    }
+    uint64_t offset = (TWOCATS_HUGE2M - ((uintptr_t)mem & (TWOCATS_HUGE2M - 1))) &
+        (TWOCATS_HUGE2M - 1);
+    if(offset != 0) {
+        munmap(mem, offset);
+    }
+    munmap(mem + offset + size, TWOCATS_HUGE2M - offset);
+    mem += offset;
+    if(madvise(mem, size, MADV_HUGEPAGE)) {
+        munmap(mem, size);
+        return NULL;
+    }
+    *(volatile uint8_t *)mem = 0;
+    if(anonHugePageBytes(mem) == 0) {
+        munmap(mem, size);
+        return NULL;
+    }
+    return mem;
+}
+#endif
+
+// Allocate 64-byte aligned memory for hashing 2^memCost KiB, using the largest pages up
+// to pageMode that we can get.  If the kernel has no huge pages of the requested size
+// reserved, fall back to smaller ones, and finally to normal pages.  The page mode
+// obtained is written to obtainedPageMode, if not NULL, and must be passed to
+// TwoCats_FreeMemory.  Return NULL if out of memory.
+void *TwoCats_AllocateMemory(uint8_t memCost, TwoCats_PageMode pageMode,
+        TwoCats_PageMode *obtainedPageMode) {
+    uint64_t size = (uint64_t)1024 << memCost;
+    void *mem = NULL;
+    // Don't round small regions up to a whole huge page
+#if defined(MAP_HUGETLB)
+    if(pageMode >= TWOCATS_PAGES_HUGE1G && size >= TWOCATS_HUGE1G) {
+        mem = mapHugePages(mappedSize(memCost, TWOCATS_PAGES_HUGE1G), MAP_HUGE_1GB);
+        if(mem != NULL) {
+            pageMode = TWOCATS_PAGES_HUGE1G;
+        }
+    }
+    if(mem == NULL && pageMode >= TWOCATS_PAGES_HUGE2M && size >= TWOCATS_HUGE2M) {
+        mem = mapHugePages(mappedSize(memCost, TWOCATS_PAGES_HUGE2M), MAP_HUGE_2MB);
+        if(mem != NULL) {
+            pageMode = TWOCATS_PAGES_HUGE2M;
+        }
+    }
+#endif
+#if defined(MADV_HUGEPAGE)
+    if(mem == NULL && pageMode >= TWOCATS_PAGES_TRANSPARENT && size >= TWOCATS_HUGE2M) {
+        mem = mapTransparentHugePages(mappedSize(memCost, TWOCATS_PAGES_TRANSPARENT));
+        if(mem != NULL) {
+            pageMode = TWOCATS_PAGES_TRANSPARENT;
+        }
+    }
+#endif
+    if(mem == NULL) {
+        pageMode = TWOCATS_PAGES_DEFAULT;
+        if(posix_memalign(&mem, 64, size)) {
+            return NULL;
+        }
+    }
+    if(obtainedPageMode != NULL) {
+        *obtainedPageMode = pageMode;
+    }
+    return mem;
+}
+
+// Free memory from TwoCats_AllocateMemory.  memCost and pageMode must be the ones it
+// was allocated with.
+void TwoCats_FreeMemory(void *mem, uint8_t memCost, TwoCats_PageMode pageMode) {
+    if(mem == NULL) {
+        return;
+    }
+    if(pageMode == TWOCATS_PAGES_DEFAULT) {
+        free(mem);
+    } else {
+        munmap(mem, mappedSize(memCost, pageMode));
+    }
+}
@@ -11,53 +11,17 @@
    this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
 */
 
+// Needed for pthread_setaffinity_np with -std=c99
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <byteswap.h>
-#include "twocats-internal.h"
-
-// This include code copied from blake2s.c
-#ifdef __AVX2__
-#define HAVE_AVX2
-#endif
-#include "../blake2-sse/blake2-config.h"
-
 #include <emmintrin.h>
-#if defined(HAVE_SSSE3)
-#include <tmmintrin.h>
-#endif
-#if defined(HAVE_SSE41)
-#include <smmintrin.h>
-#endif
-#if defined(HAVE_AVX)
-#include <immintrin.h>
-#endif
-#if defined(HAVE_XOP)
-#include <x86intrin.h>
-#endif
-
-// This rotate code is motivated from blake2s-round.h
-#ifdef HAVE_AVX2
-#define DECLARE_ROTATE256_CONSTS \
-    __m256i shuffleVal = _mm256_set_epi8(30, 29, 28, 31, 26, 25, 24, 27, 22, 21, 20, 23, 18, 17, 16, 19, \
-        14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
-#define ROTATE_LEFT8_256(s) _mm256_shuffle_epi8(s, shuffleVal)
-#endif
-
-#ifndef HAVE_XOP
-#ifdef HAVE_SSSE3
-#define DECLARE_ROTATE128_CONSTS \
-    __m128i shuffleVal = _mm_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
-#define ROTATE_LEFT8_128(s) _mm_shuffle_epi8(s, shuffleVal)
-#else
-#define DECLARE_ROTATE128_CONSTS \
-    __m128i shiftRightVal = _mm_set_epi32(24, 24, 24, 24); \
-    __m128i shiftLeftVal = _mm_set_epi32(8, 8, 8, 8);
-#define ROTATE_LEFT8_128(s) _mm_or_si128(_mm_srl_epi32(s, shiftRightVal), _mm_sll_epi32(s, shiftLeftVal))
-#endif
-#endif
+#include "twocats-internal.h"
 
 // This structure is shared among all threads.
 struct TwoCatsCommonDataStruct {
@@ -69,7 +33,18 @@ struct TwoCatsCommonDataStruct {
     uint32_t blocksPerThread;
     uint8_t multiplies;
     uint8_t lanes;
-    uint32_t completedBlocks;
+    uint32_t resistantSlices;
+    struct TwoCatsContextStruct *threads;
+    // Kernels for sub-blocks, and for whole blocks in the resistant slices
+    TwoCats_HashBlocksFunc hashBlocks;
+    TwoCats_HashBlocksFunc hashBlocksResistant;
+    TwoCats_HashBlocksStreamingFunc hashBlocksStreaming;
+    TwoCats_HashBlocksStreamingFunc hashBlocksStreamingResistant;
+    bool streaming; // Write memory with streaming stores
+    // The event callback, if there is one, and the level's event, which slice events copy
+    TwoCats_EventCallback callback;
+    void *userData;
+    TwoCats_Event levelEvent;
 };
 
 // This structure is unique to each memory-hashing thread
@@ -78,6 +53,84 @@ struct TwoCatsContextStruct {
     struct TwoCatsCommonDataStruct *common;
     uint32_t *state;
     uint32_t p; // This is the memory-thread number
+    uint32_t blocksDone; // Blocks hashed so far at this level, published for other threads
+    uint32_t *prevBlocks; // When streaming, copies of the last two blocks we hashed
+};
+
+// Up to this many hashes run in lock-step in TwoCats_Batch.
+#define TWOCATS_BATCHWIDTH 8
+// TwoCats_Batch only runs hashes in lock-step if all their memory fits in the last level
+// cache, or in this much if we don't know its size.
+#define TWOCATS_BATCHMAXMEM ((uint64_t)8 << 20)
+
+// Lock-step hashing state for TwoCats_Batch.  Lanes past numHashes are dummies with
+// their own states, so the Blake2s code can always do 8.
+struct TwoCatsBatchStruct {
+    TwoCats_H *H;
+    uint32_t *hash32s[TWOCATS_BATCHWIDTH];
+    uint32_t *mems[TWOCATS_BATCHWIDTH];
+    uint32_t *states[TWOCATS_BATCHWIDTH];
+    uint32_t numHashes;
+    uint32_t blocklen;
+    uint32_t subBlocklen;
+    uint8_t multiplies;
+    uint8_t lanes;
+    TwoCats_HashBlocksFunc hashBlocks;
+    TwoCats_HashBlocksFunc hashBlocksResistant;
+    TwoCats_HashStates8Func hashStates8;
+};
+
+// How many times a thread polls another thread's progress before yielding the CPU.
+#define TWOCATS_SPINCOUNT 64
+
+// A parked memory-hashing thread.  Workers are created on demand, never exit, and are
+// shared by every TwoCats call in the process, so we don't pay for thread creation and
+// stack faulting on every slice of every garlic level.
+struct TwoCatsWorkerStruct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    void *(*func)(void *); // Non-NULL while the worker has a job to do
+    void *arg;
+    struct TwoCatsWorkerStruct *nextIdle;
+    int32_t cpu; // The CPU this worker is pinned to, or -1 if it can run anywhere
+};
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+static struct TwoCatsWorkerStruct *idleWorkers = NULL;
+// Set by TwoCats_SetThreadAffinity, and protected by poolMutex
+static uint32_t *affinityCpus = NULL;
+static uint32_t numAffinityCpus = 0;
+
+// Find the memory hashing kernels in twocats-kernel.c, indexed by TwoCats_Implementation.
+static const TwoCats_FindHashBlocksFunc findHashBlocksFuncs[TWOCATS_IMPL_NONE] = {
+    TwoCats_FindHashBlocksGeneric,
+    TwoCats_FindHashBlocksSSE2,
+    TwoCats_FindHashBlocksSSSE3,
+    TwoCats_FindHashBlocksSSE41,
+    TwoCats_FindHashBlocksAVX2,
+    TwoCats_FindHashBlocksAVX512
+};
+
+// Find the streaming store kernels, indexed by TwoCats_Implementation.
+static const TwoCats_FindHashBlocksStreamingFunc findHashBlocksStreamingFuncs[TWOCATS_IMPL_NONE] = {
+    TwoCats_FindHashBlocksStreamingGeneric,
+    TwoCats_FindHashBlocksStreamingSSE2,
+    TwoCats_FindHashBlocksStreamingSSSE3,
+    TwoCats_FindHashBlocksStreamingSSE41,
+    TwoCats_FindHashBlocksStreamingAVX2,
+    TwoCats_FindHashBlocksStreamingAVX512
+};
+
+// The 8-way Blake2s HashState in twocats-blake2s.c, indexed by TwoCats_Implementation.
+static const TwoCats_HashStates8Func hashStates8Funcs[TWOCATS_IMPL_NONE] = {
+    TwoCats_Blake2sHashStates8Generic,
+    TwoCats_Blake2sHashStates8SSE2,
+    TwoCats_Blake2sHashStates8SSSE3,
+    TwoCats_Blake2sHashStates8SSE41,
+    TwoCats_Blake2sHashStates8AVX2,
+    TwoCats_Blake2sHashStates8AVX512
 };
 
 // Add the last hashed data into the result.
@@ -89,306 +142,115 @@ static void addIntoHash(TwoCats_H *H, uint32_t *hash32, uint32_t parallelism, ui
     }
 }
 
-#if defined(HAVE_AVX2)
-static void convStateFromUint32ToM256i(uint32_t state[8], __m256i *v) {
-    *v = _mm256_set_epi32(state[7], state[6], state[5], state[4], state[3], state[2], state[1], state[0]);
-}
-
-// Convert two __m256i to uint32_t[8].
-static void convStateFromM256iToUint32(__m256i *v, uint32_t state[8]) {
-    uint32_t *p = (uint32_t *)v;
-    uint32_t i;
-    for(i = 0; i < 8; i++) {
-        state[i] = p[i];
+// Bit-reversal function derived from Catena's version.
+static inline uint32_t reverse(uint32_t x, const uint8_t n)
+{
+    if(n == 0) {
+        return 0;
     }
+    x = bswap_32(x);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x >> (32 - n);
 }
-#endif
-#if defined(HAVE_SSE2)
-// Convert a uint32_t[8] to two __m128i values. len must be 4 or 8.
-static void convStateFromUint32ToM128i(uint32_t state[8], __m128i *v1, __m128i *v2, uint8_t len) {
-    *v1 = _mm_set_epi32(state[3], state[2], state[1], state[0]);
-    if(len == 8) {
-        *v2 = _mm_set_epi32(state[7], state[6], state[5], state[4]);
+
+// The "sliding reverse" position of each block in the resistant slices depends only on
+// the block's index, so the positions for the first TWOCATS_SCHEDULELEN blocks of any
+// thread's memory are computed once and shared by every hash.  Later blocks are computed
+// as we go.
+#define TWOCATS_SCHEDULELEN (1 << 16)
+static uint16_t reverseSchedule[TWOCATS_SCHEDULELEN];
+static pthread_once_t scheduleOnce = PTHREAD_ONCE_INIT;
+
+// Use Solar Designer's sliding-power-of-two window, with Catena's bit-reversal, to find the
+// block to hash with block i.
+static inline uint32_t computeSlidingReverse(uint32_t i) {
+    uint32_t numBits = 32 - __builtin_clz(i); // The number of bits in i
+    uint32_t reversePos = reverse(i, numBits-1);
+    if(reversePos + (1 << (numBits-1)) < i) {
+        reversePos += 1 << (numBits-1);
     }
+    return reversePos;
 }
 
-// Convert two __m128i to uint32_t*. len must be 4 or 8.
-static void convStateFromM128iToUint32(__m128i *v1, __m128i *v2, uint32_t *state, uint8_t len) {
-    uint32_t *p = (uint32_t *)v1;
-    uint32_t i;
-    for(i = 0; i < 4; i++) {
-        state[i] = p[i];
-    }
-    if(len == 8) {
-        p = (uint32_t *)v2;
-        for(i = 0; i < 4; i++) {
-            state[i+4] = p[i];
-        }
+// Fill in the shared schedule.
+static void initSchedule(void) {
+    for(uint32_t i = 1; i < TWOCATS_SCHEDULELEN; i++) {
+        reverseSchedule[i] = computeSlidingReverse(i);
     }
 }
-#endif
-
-/* Hash three blocks together with fast SSE friendly hash function optimized for high memory bandwidth.
-   Basically, it does for every 8 words:
-       for(i = 0; i < 8; i++) {
-           state[i] = ROTATE_LEFT((state[i] + *p++) ^ *f++, 8);
-           *t++ = state[i];
-  
-   TODO: Optimizations for ARM, and widths other than 8 should be written as well. */
-       
-static inline void hashBlocksInner(TwoCats_H *H, uint32_t *state, uint32_t *mem,
-        uint32_t blocklen, uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr,
-        uint64_t toAddr, uint8_t multiplies, uint8_t lanes) {
-
-    // Do SIMD friendly memory hashing and a scalar CPU friendly parallel multiplication chain
-    uint32_t numSubBlocks = blocklen/subBlocklen;
-    uint32_t a = state[0];
-    uint32_t b = state[1];
-    uint32_t c = state[2];
-    uint32_t d = state[3];
-
-    bool haveFastCode = false;
-    if(lanes == 8) {
-#if defined(HAVE_AVX2)
-        haveFastCode = true;
-        __m256i s;
-        convStateFromUint32ToM256i(state, &s);
-        __m256i *m = (__m256i *)mem;
-        DECLARE_ROTATE256_CONSTS
-        __m256i *f;
-        __m256i *t;
-        __m256i *p;
-        f = m + fromAddr/8;
-        t = m + toAddr/8;
-        for(uint32_t i = 0; i < numSubBlocks; i++) {
-            uint32_t randVal = *(uint32_t *)f;
-            p = m + prevAddr/8 + (subBlocklen/8)*(randVal & (numSubBlocks - 1));
-            for(uint32_t j = 0; j < subBlocklen/8; j++) {
-
-                // Compute the multiplication chain
-                for(uint8_t k = 0; k < multiplies; k++) {
-                    a ^= (uint64_t)b*c >> 32;
-                    b += c;
-                    c ^= (uint64_t)a*d >> 32;
-                    d += a;
-                }
 
-                // Hash 32 bytes of memory
-                s = _mm256_add_epi32(s, *p++);
-                s = _mm256_xor_si256(s, *f++);
-                s = ROTATE_LEFT8_256(s);
-                *t++ = s;
-            }
-        }
-        convStateFromM256iToUint32(&s, state);
-#elif defined(HAVE_SSE2)
-        haveFastCode = true;
-        __m128i s1;
-        __m128i s2;
-        convStateFromUint32ToM128i(state, &s1, &s2, 8);
-        __m128i *m = (__m128i *)mem;
-        DECLARE_ROTATE128_CONSTS
-        __m128i *f;
-        __m128i *t;
-        __m128i *p;
-        f = m + fromAddr/4;
-        t = m + toAddr/4;
-        for(uint32_t i = 0; i < numSubBlocks; i++) {
-            uint32_t randVal = *(uint32_t *)f;
-            p = m + prevAddr/4 + (subBlocklen/4)*(randVal & (numSubBlocks - 1));
-            for(uint32_t j = 0; j < subBlocklen/8; j++) {
-
-                // Compute the multiplication chain
-                for(uint8_t k = 0; k < multiplies; k++) {
-                    a ^= (uint64_t)b*c >> 32;
-                    b += c;
-                    c ^= (uint64_t)a*d >> 32;
-                    d += a;
-                }
-
-                // Hash 32 bytes of memory
-                s1 = _mm_add_epi32(s1, *p++);
-                s1 = _mm_xor_si128(s1, *f++);
-                // Rotate left 8
-                s1 = ROTATE_LEFT8_128(s1);
-                *t++ = s1;
-                s2 = _mm_add_epi32(s2, *p++);
-                s2 = _mm_xor_si128(s2, *f++);
-                // Rotate left 8
-                s2 = ROTATE_LEFT8_128(s2);
-                *t++ = s2;
-            }
-        }
-        convStateFromM128iToUint32(&s1, &s2, state, 8);
-#endif
-    } else if(lanes == 4) {
-#if defined(HAVE_SSE2)
-        haveFastCode = true;
-        __m128i s;
-        convStateFromUint32ToM128i(state, &s, &s, 4);
-        __m128i *m = (__m128i *)mem;
-        DECLARE_ROTATE128_CONSTS
-        __m128i *f;
-        __m128i *t;
-        __m128i *p;
-        f = m + fromAddr/4;
-        t = m + toAddr/4;
-        for(uint32_t i = 0; i < numSubBlocks; i++) {
-            uint32_t randVal = *(uint32_t *)f;
-            p = m + prevAddr/4 + (subBlocklen/4)*(randVal & (numSubBlocks - 1));
-            for(uint32_t j = 0; j < subBlocklen/4; j++) {
-
-                // Compute the multiplication chain
-                for(uint8_t k = 0; k < multiplies; k++) {
-                    a ^= (uint64_t)b*c >> 32;
-                    b += c;
-                    c ^= (uint64_t)a*d >> 32;
-                    d += a;
-                }
-
-                // Hash 16 bytes of memory
-                s = _mm_add_epi32(s, *p++);
-                s = _mm_xor_si128(s, *f++);
-                // Rotate left 8
-                s = ROTATE_LEFT8_128(s);
-                *t++ = s;
-            }
-        }
-        convStateFromM128iToUint32(&s, &s, state, 4);
-#endif
-    } else if(lanes == 2) {
-        // TODO: write 2-lane code here using MMX
-    }
-    if(!haveFastCode) {
-        uint32_t *f = mem + fromAddr;
-        uint32_t *t = mem + toAddr;
-        for(uint32_t i = 0; i < numSubBlocks; i++) {
-            uint32_t randVal = *f;
-            uint32_t *p = mem + prevAddr + subBlocklen*(randVal & (numSubBlocks - 1));
-            for(uint32_t j = 0; j < subBlocklen/lanes; j++) {
-
-                // Compute the multiplication chain
-                for(uint32_t k = 0; k < multiplies; k++) {
-                    a ^= (uint64_t)b*c >> 32;
-                    b += c;
-                    c ^= (uint64_t)a*d >> 32;
-                    d += a;
-                }
-
-                // Hash lanes of memory
-                for(uint32_t k = 0; k < lanes; k++) {
-                    state[k] = (state[k] + *p++) ^ *f++;
-                    state[k] = (state[k] >> 24) | (state[k] << 8);
-                    *t++ = state[k];
-                }
-            }
-        }
+// Return the block to hash with block i in the resistant slices.  i must be at least 1.
+static inline uint32_t slidingReverse(uint32_t i) {
+    if(i < TWOCATS_SCHEDULELEN) {
+        return reverseSchedule[i];
     }
-    H->HashState(H, state, a);
+    return computeSlidingReverse(i);
 }
 
-// This crazy wrapper is simply to force to optimizer to unroll the subBlocklen inner loop.
-static inline void hashBlocksSubBlocklen(TwoCats_H *H, uint32_t state[8], uint32_t *mem, uint32_t blocklen,
-        uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
-        uint8_t multiplies, uint8_t lanes) {
-    switch(subBlocklen) {
-    case 1:
-        hashBlocksInner(H, state, mem, blocklen, 1, fromAddr, prevAddr, toAddr, multiplies, lanes);
-        break;
-    case 2:
-        hashBlocksInner(H, state, mem, blocklen, 2, fromAddr, prevAddr, toAddr, multiplies, lanes);
-        break;
-    case 4:
-        hashBlocksInner(H, state, mem, blocklen, 4, fromAddr, prevAddr, toAddr, multiplies, lanes);
-        break;
-    case 8:
-        hashBlocksInner(H, state, mem, blocklen, 8, fromAddr, prevAddr, toAddr, multiplies, lanes);
-        break;
-    case 16:
-        hashBlocksInner(H, state, mem, blocklen, 16, fromAddr, prevAddr, toAddr, multiplies, lanes);
-        break;
-    default:
-        hashBlocksInner(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, multiplies, lanes);
+// Ask for a block to be loaded into the L2 cache.  We do this for the next block's
+// from-block while hashing the current block, since the resistant slices know it ahead
+// of time.
+static inline void prefetchBlock(const uint32_t *block, uint32_t blocklen) {
+    for(uint32_t j = 0; j < blocklen && j < 256; j += 16) {
+        __builtin_prefetch(block + j, 0, 2);
     }
 }
 
-// This crazy wrapper is simply to force to optimizer to unroll the lanes loop.
-static inline void hashBlocksLanes(TwoCats_H *H, uint32_t state[8], uint32_t *mem, uint32_t blocklen,
-        uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
-        uint8_t multiplies, uint8_t lanes) {
-    switch(lanes) {
-    case 1:
-        hashBlocksSubBlocklen(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, multiplies, 1);
-        break;
-    case 2:
-        hashBlocksSubBlocklen(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, multiplies, 2);
-        break;
-    case 4:
-        hashBlocksSubBlocklen(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, multiplies, 4);
-        break;
-    case 8:
-        hashBlocksSubBlocklen(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, multiplies, 8);
-        break;
-    case 16:
-        hashBlocksSubBlocklen(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, multiplies, 16);
-        break;
-    default:
-        hashBlocksSubBlocklen(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, multiplies, lanes);
+// Wait until memory-thread q has hashed the given block of its memory.  Threads do not wait
+// for each other between slices, so this is the only synchronization while hashing memory.
+// Only time it when we have to wait.
+static inline void waitForBlock(struct TwoCatsCommonDataStruct *c, uint32_t q, uint32_t block) {
+    uint32_t *blocksDone = &(c->threads[q].blocksDone);
+    if(__atomic_load_n(blocksDone, __ATOMIC_ACQUIRE) > block) {
+        return;
+    }
+    uint64_t start = TwoCats_GetNanoseconds();
+    uint32_t spins = 0;
+    while(__atomic_load_n(blocksDone, __ATOMIC_ACQUIRE) <= block) {
+        if(++spins < TWOCATS_SPINCOUNT) {
+            _mm_pause();
+        } else {
+            sched_yield();
+        }
     }
+    TwoCats_AddStat(&TwoCats_GetThreadStats()->waitNanoseconds,
+        TwoCats_GetNanoseconds() - start);
 }
 
-// This crazy wrapper is simply to force to optimizer to unroll the multiplication loop.
-static inline void hashBlocks(TwoCats_H *H, uint32_t state[8], uint32_t *mem, uint32_t blocklen,
-        uint32_t subBlocklen, uint64_t fromAddr, uint64_t prevAddr, uint64_t toAddr,
-        uint8_t multiplies, uint8_t lanes) {
-    switch(multiplies) {
-    case 0:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 0, lanes);
-        break;
-    case 1:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 1, lanes);
-        break;
-    case 2:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 2, lanes);
-        break;
-    case 3:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 3, lanes);
-        break;
-    case 4:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 4, lanes);
-        break;
-    case 5:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 5, lanes);
-        break;
-    case 6:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 6, lanes);
-        break;
-    case 7:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 7, lanes);
-        break;
-    case 8:
-        hashBlocksLanes(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr, 8, lanes);
-        break;
-    }
+// Tell the other threads that our blocks before numBlocks can be read.
+static inline void publishBlocks(struct TwoCatsContextStruct *ctx, uint32_t numBlocks) {
+    __atomic_store_n(&(ctx->blocksDone), numBlocks, __ATOMIC_RELEASE);
 }
 
-// Bit-reversal function derived from Catena's version.
-static inline uint32_t reverse(uint32_t x, const uint8_t n)
-{
-    if(n == 0) {
-        return 0;
+// Hash the previous block and the block at fromAddr into block i of our memory, at toAddr.
+// In the resistant slices, the whole block is one sub-block.  When streaming, the
+// previous block is read from our copy of it, since the copy in memory is not in the cache.
+static inline void hashBlock(struct TwoCatsContextStruct *ctx, uint32_t i, uint64_t fromAddr,
+        uint64_t toAddr, bool resistant) {
+    struct TwoCatsCommonDataStruct *c = ctx->common;
+    uint32_t blocklen = c->blocklen;
+    uint32_t subBlocklen = resistant? blocklen : c->subBlocklen;
+    uint32_t value;
+    if(c->streaming) {
+        uint32_t *prevBlock = ctx->prevBlocks + ((i - 1) & 1)*blocklen;
+        uint32_t *copyBlock = ctx->prevBlocks + (i & 1)*blocklen;
+        TwoCats_HashBlocksStreamingFunc hashBlocks = resistant?
+            c->hashBlocksStreamingResistant : c->hashBlocksStreaming;
+        value = hashBlocks(ctx->state, c->mem, blocklen, subBlocklen, fromAddr, prevBlock,
+            toAddr, copyBlock, c->multiplies, c->lanes);
+    } else {
+        TwoCats_HashBlocksFunc hashBlocks = resistant? c->hashBlocksResistant : c->hashBlocks;
+        value = hashBlocks(ctx->state, c->mem, blocklen, subBlocklen, fromAddr,
+            toAddr - blocklen, toAddr, c->multiplies, c->lanes);
     }
-    x = bswap_32(x);
-    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
-    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
-    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
-    return x >> (32 - n);
+    ctx->H.HashState(&(ctx->H), ctx->state, value);
 }
 
 // Hash memory without doing any password dependent memory addressing to thwart cache-timing-attacks.
 // Use Solar Designer's sliding-power-of-two window, with Catena's bit-reversal.
-static void *hashWithoutPassword(void *contextPtr) {
-    struct TwoCatsContextStruct *ctx = (struct TwoCatsContextStruct *)contextPtr;
+static void hashWithoutPassword(struct TwoCatsContextStruct *ctx, uint32_t completedBlocks) {
     struct TwoCatsCommonDataStruct *c = ctx->common;
 
     TwoCats_H *H = &(ctx->H);
@@ -397,66 +259,64 @@ static void *hashWithoutPassword(void *contextPtr) {
     uint32_t p = ctx->p;
     uint32_t blocklen = c->blocklen;
     uint32_t blocksPerThread = c->blocksPerThread;
-    uint8_t multiplies = c->multiplies;
-    uint32_t lanes = c->lanes;
     uint32_t parallelism = c->parallelism;
-    uint32_t completedBlocks = c->completedBlocks;
 
     uint64_t start = blocklen*blocksPerThread*p;
     uint32_t firstBlock = completedBlocks;
     if(completedBlocks == 0) {
         // Initialize the first block of memory
         H->ExpandUint32(H, mem + start, blocklen, state);
+        if(c->streaming) {
+            memcpy(ctx->prevBlocks, mem + start, blocklen*sizeof(uint32_t));
+        }
         firstBlock = 1;
+        publishBlocks(ctx, 1);
     }
 
     // Hash one "slice" worth of memory hashing
-    uint32_t numBits = 1; // The number of bits in i
-    for(uint32_t i = firstBlock; i < completedBlocks + blocksPerThread/TWOCATS_SLICES; i++) {
-        while(1 << numBits <= i) {
-            numBits++;
-        }
-
-        // Compute the "sliding reverse" block position
-        uint32_t reversePos = reverse(i, numBits-1);
-        if(reversePos + (1 << (numBits-1)) < i) {
-            reversePos += 1 << (numBits-1);
-        }
+    uint32_t stopBlock = completedBlocks + blocksPerThread/TWOCATS_SLICES;
+    for(uint32_t i = firstBlock; i < stopBlock; i++) {
 
-        // Hash the prior block and the block at reversePos and write the result
+        // Hash the prior block and the block at the "sliding reverse" position and write
+        // the result
+        uint32_t reversePos = slidingReverse(i);
         uint64_t fromAddr = blocklen*reversePos;
 
         // Compute which thread's memory to read from
         if(fromAddr < completedBlocks*blocklen) {
+            waitForBlock(c, i % parallelism, reversePos);
             fromAddr += blocklen*blocksPerThread*(i % parallelism);
         } else {
             fromAddr += start;
         }
 
-        uint64_t toAddr = start + i*blocklen;
-        uint64_t prevAddr = toAddr - blocklen;
-        hashBlocks(H, state, mem, blocklen, blocklen, fromAddr, prevAddr, toAddr,
-            multiplies, lanes);
+        // Start loading the next block's from-block.  If another thread has not written
+        // it yet, this is just a wasted hint.
+        if(i + 1 < stopBlock) {
+            uint32_t nextPos = slidingReverse(i + 1);
+            uint64_t nextAddr = blocklen*nextPos;
+            if(nextAddr < completedBlocks*blocklen) {
+                nextAddr += blocklen*blocksPerThread*((i + 1) % parallelism);
+            } else {
+                nextAddr += start;
+            }
+            prefetchBlock(mem + nextAddr, blocklen);
+        }
+
+        hashBlock(ctx, i, fromAddr, start + i*blocklen, true);
+        publishBlocks(ctx, i + 1);
     }
-    pthread_exit(NULL);
 }
 
 // Hash memory with password dependent addressing.
-static void *hashWithPassword(void *contextPtr) {
-    struct TwoCatsContextStruct *ctx = (struct TwoCatsContextStruct *)contextPtr;
+static void hashWithPassword(struct TwoCatsContextStruct *ctx, uint32_t completedBlocks) {
     struct TwoCatsCommonDataStruct *c = ctx->common;
 
-    TwoCats_H *H = &(ctx->H);
     uint32_t *state = ctx->state;
-    uint32_t *mem = c->mem;
     uint32_t p = ctx->p;
     uint64_t blocklen = c->blocklen;
-    uint32_t subBlocklen = c->subBlocklen;
     uint32_t blocksPerThread = c->blocksPerThread;
-    uint8_t multiplies = c->multiplies;
-    uint8_t lanes = c->lanes;
     uint32_t parallelism = c->parallelism;
-    uint32_t completedBlocks = c->completedBlocks;
     uint64_t start = blocklen*blocksPerThread*p;
 
     for(uint32_t i = completedBlocks; i < completedBlocks + blocksPerThread/TWOCATS_SLICES; i++) {
@@ -472,17 +332,304 @@ static void *hashWithPassword(void *contextPtr) {
 
         // Compute which thread's memory to read from
         if(fromAddr < completedBlocks*blocklen) {
+            waitForBlock(c, state[1] % parallelism, i - 1 - distance);
             fromAddr += blocklen*(state[1] % parallelism)*blocksPerThread;
         } else {
             fromAddr += start;
         }
 
-        uint64_t toAddr = start + i*blocklen;
-        uint64_t prevAddr = toAddr - blocklen;
-        hashBlocks(H, state, mem, blocklen, subBlocklen, fromAddr, prevAddr, toAddr,
-            multiplies, lanes);
+        hashBlock(ctx, i, fromAddr, start + i*blocklen, false);
+        publishBlocks(ctx, i + 1);
+    }
+}
+
+// Report the start or end of one of this thread's slices to the event callback, if there
+// is one.
+static inline void reportSlice(struct TwoCatsContextStruct *ctx, TwoCats_EventType type,
+        uint32_t slice) {
+    struct TwoCatsCommonDataStruct *c = ctx->common;
+    if(c->callback != NULL) {
+        TwoCats_Event event = c->levelEvent;
+        event.type = type;
+        event.thread = ctx->p;
+        event.slice = slice;
+        event.resistant = slice < c->resistantSlices;
+        event.bytes = (uint64_t)c->blocksPerThread/TWOCATS_SLICES*c->blocklen*sizeof(uint32_t);
+        c->callback(&event, c->userData);
+    }
+}
+
+// Hash all the slices of one thread's memory for one level of garlic.  A thread only reads
+// other threads' memory from earlier slices, and waits only if that block is not yet
+// hashed, so a delayed thread does not stall the others at every slice boundary.  Define
+// TWOCATS_SLICE_BARRIERS to make every thread finish a slice before any starts the next.
+static void *hashThreadMemory(void *contextPtr) {
+    struct TwoCatsContextStruct *ctx = (struct TwoCatsContextStruct *)contextPtr;
+    struct TwoCatsCommonDataStruct *c = ctx->common;
+    TwoCats_Stats *stats = TwoCats_GetThreadStats();
+
+    for(uint32_t slice = 0; slice < TWOCATS_SLICES; slice++) {
+        uint32_t completedBlocks = slice*c->blocksPerThread/TWOCATS_SLICES;
+#ifdef TWOCATS_SLICE_BARRIERS
+        for(uint32_t q = 0; q < c->parallelism && completedBlocks != 0; q++) {
+            waitForBlock(c, q, completedBlocks - 1);
+        }
+#endif
+        reportSlice(ctx, TWOCATS_EVENT_SLICE_BEGIN, slice);
+        TWOCATS_PROBE5(slice__start, c->levelEvent.memCost, c->lanes, c->parallelism, ctx->p,
+            slice);
+        uint64_t start = TwoCats_GetNanoseconds();
+        if(slice < c->resistantSlices) {
+            hashWithoutPassword(ctx, completedBlocks);
+            uint64_t end = TwoCats_GetNanoseconds();
+            TwoCats_AddStat(&stats->resistantNanoseconds, end - start);
+            TwoCats_Trace(TWOCATS_TRACE_RESISTANT, start, end, c->levelEvent.memCost, slice,
+                ctx->p);
+        } else {
+            hashWithPassword(ctx, completedBlocks);
+            uint64_t end = TwoCats_GetNanoseconds();
+            TwoCats_AddStat(&stats->passwordNanoseconds, end - start);
+            TwoCats_Trace(TWOCATS_TRACE_PASSWORD, start, end, c->levelEvent.memCost, slice,
+                ctx->p);
+        }
+        TWOCATS_PROBE5(slice__done, c->levelEvent.memCost, c->lanes, c->parallelism, ctx->p,
+            slice);
+        reportSlice(ctx, TWOCATS_EVENT_SLICE_END, slice);
+    }
+    return NULL;
+}
+
+// The main loop of a worker thread: sleep until given a job, run it, and report back.
+static void *workerMain(void *workerPtr) {
+    struct TwoCatsWorkerStruct *w = (struct TwoCatsWorkerStruct *)workerPtr;
+    pthread_mutex_lock(&w->mutex);
+    while(1) {
+        while(w->func == NULL) {
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        void *(*func)(void *) = w->func;
+        void *arg = w->arg;
+        pthread_mutex_unlock(&w->mutex);
+        func(arg);
+        pthread_mutex_lock(&w->mutex);
+        w->func = NULL;
+        pthread_cond_broadcast(&w->cond);
+    }
+    return NULL;
+}
+
+// A forked child only has the thread that called fork, so forget the parent's workers.
+static void resetPoolInChild(void) {
+    pthread_mutex_init(&poolMutex, NULL);
+    idleWorkers = NULL;
+}
+
+// Set up the pool the first time a worker is needed.
+static void initPool(void) {
+    pthread_atfork(NULL, NULL, resetPoolInChild);
+}
+
+// Take a parked worker from the pool, or start a new one if they are all busy.  Return
+// NULL if we can't start a thread.
+static struct TwoCatsWorkerStruct *acquireWorker(void) {
+    pthread_once(&poolOnce, initPool);
+    pthread_mutex_lock(&poolMutex);
+    struct TwoCatsWorkerStruct *w = idleWorkers;
+    if(w != NULL) {
+        idleWorkers = w->nextIdle;
+    }
+    pthread_mutex_unlock(&poolMutex);
+    if(w != NULL) {
+        return w;
+    }
+    w = calloc(1, sizeof(struct TwoCatsWorkerStruct));
+    if(w == NULL) {
+        return NULL;
+    }
+    w->cpu = -1;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if(pthread_create(&w->thread, NULL, workerMain, w)) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->mutex);
+        free(w);
+        return NULL;
     }
-    pthread_exit(NULL);
+    pthread_detach(w->thread);
+    return w;
+}
+
+// Park a worker back in the pool.
+static void releaseWorker(struct TwoCatsWorkerStruct *w) {
+    pthread_mutex_lock(&poolMutex);
+    w->nextIdle = idleWorkers;
+    idleWorkers = w;
+    pthread_mutex_unlock(&poolMutex);
+}
+
+// Hand a job to a parked worker.
+static void startWorker(struct TwoCatsWorkerStruct *w, void *(*func)(void *), void *arg) {
+    pthread_mutex_lock(&w->mutex);
+    w->arg = arg;
+    w->func = func;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+// Wait for a worker to finish its job.
+static void waitForWorker(struct TwoCatsWorkerStruct *w) {
+    pthread_mutex_lock(&w->mutex);
+    while(w->func != NULL) {
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+// Pin a parked worker to a CPU, or let it run anywhere the calling thread can if cpu is
+// -1.  Return false if the CPU does not exist or we are not allowed to use it.
+static bool pinWorker(struct TwoCatsWorkerStruct *w, int32_t cpu) {
+    if(w->cpu == cpu) {
+        return true;
+    }
+    cpu_set_t cpus;
+    if(cpu < 0) {
+        if(pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus)) {
+            return false;
+        }
+    } else {
+        if(cpu >= CPU_SETSIZE) {
+            return false;
+        }
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+    }
+    if(pthread_setaffinity_np(w->thread, sizeof(cpu_set_t), &cpus)) {
+        return false;
+    }
+    w->cpu = cpu;
+    return true;
+}
+
+// Get workers for threads firstThread through numThreads - 1.  When
+// TwoCats_SetThreadAffinity has set a CPU list, thread p runs on a worker pinned to
+// CPU p (modulo the list length), and firstThread should be 0 so that every thread is
+// pinned.  Return false if we can't start enough threads.
+static bool acquireWorkers(struct TwoCatsWorkerStruct **workers, uint32_t firstThread,
+        uint32_t numThreads) {
+    pthread_mutex_lock(&poolMutex);
+    uint32_t numCpus = numAffinityCpus;
+    uint32_t cpus[numCpus + 1];
+    for(uint32_t i = 0; i < numCpus; i++) {
+        cpus[i] = affinityCpus[i];
+    }
+    pthread_mutex_unlock(&poolMutex);
+    for(uint32_t p = firstThread; p < numThreads; p++) {
+        workers[p] = acquireWorker();
+        if(workers[p] == NULL) {
+            fprintf(stderr, "Unable to start threads\n");
+            while(p-- != firstThread) {
+                releaseWorker(workers[p]);
+            }
+            return false;
+        }
+        if(!pinWorker(workers[p], numCpus == 0? -1 : (int32_t)cpus[p % numCpus])) {
+            fprintf(stderr, "Unable to set thread affinity\n");
+        }
+    }
+    return true;
+}
+
+// Return true if TwoCats_SetThreadAffinity has set a CPU list.
+static bool threadsArePinned(void) {
+    pthread_mutex_lock(&poolMutex);
+    bool pinned = numAffinityCpus != 0;
+    pthread_mutex_unlock(&poolMutex);
+    return pinned;
+}
+
+// Pin memory hashing threads to CPUs: thread p runs on cpus[p % numCpus].  Memory is
+// then first touched by the thread that hashes it, so on NUMA machines it is allocated
+// on that thread's node.  Pass numCpus = 0 to let threads run anywhere again.  Return
+// false if the calling thread is not allowed to run on one of the CPUs.
+bool TwoCats_SetThreadAffinity(const uint32_t *cpus, uint32_t numCpus) {
+    uint32_t *newCpus = NULL;
+    if(numCpus != 0) {
+        cpu_set_t allowed;
+        if(pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &allowed)) {
+            return false;
+        }
+        newCpus = malloc(numCpus*sizeof(uint32_t));
+        if(newCpus == NULL) {
+            return false;
+        }
+        for(uint32_t i = 0; i < numCpus; i++) {
+            if(cpus[i] >= CPU_SETSIZE || !CPU_ISSET(cpus[i], &allowed)) {
+                free(newCpus);
+                return false;
+            }
+            newCpus[i] = cpus[i];
+        }
+    }
+    pthread_mutex_lock(&poolMutex);
+    free(affinityCpus);
+    affinityCpus = newCpus;
+    numAffinityCpus = numCpus;
+    pthread_mutex_unlock(&poolMutex);
+    return true;
+}
+
+// A piece of memory for one thread to prefault.
+struct TwoCatsPrefaultStruct {
+    volatile uint8_t *mem;
+    uint64_t size;
+};
+
+// Write to every page of one thread's piece of memory.
+static void *prefaultThreadMemory(void *prefaultPtr) {
+    struct TwoCatsPrefaultStruct *f = (struct TwoCatsPrefaultStruct *)prefaultPtr;
+    for(uint64_t i = 0; i < f->size; i += TWOCATS_PAGESIZE) {
+        f->mem[i] = 0;
+    }
+    return NULL;
+}
+
+// Write to every page of memory so it is faulted in before hashing.  The kernel zeroes
+// each page as it faults it in, so this goes about parallelism times faster split
+// across threads.  Piece p is about the region thread p hashes at the top garlic
+// level, so when threads are pinned, it is allocated on that thread's NUMA node.
+bool TwoCats_PrefaultMemory(void *memory, uint64_t size, uint8_t parallelism) {
+    if(parallelism == 0) {
+        parallelism = 1;
+    }
+    uint64_t pages = (size + TWOCATS_PAGESIZE - 1)/TWOCATS_PAGESIZE;
+    struct TwoCatsPrefaultStruct f[parallelism];
+    struct TwoCatsWorkerStruct *workers[parallelism];
+    uint64_t start = 0;
+    for(uint32_t p = 0; p < parallelism; p++) {
+        uint64_t end = TWOCATS_PAGESIZE*(pages*(p + 1)/parallelism);
+        if(end > size) {
+            end = size;
+        }
+        f[p].mem = (uint8_t *)memory + start;
+        f[p].size = end - start;
+        start = end;
+    }
+    // When threads are pinned, piece p is touched by the worker that will hash it
+    uint32_t firstWorker = threadsArePinned()? 0 : 1;
+    if(!acquireWorkers(workers, firstWorker, parallelism)) {
+        return false;
+    }
+    for(uint32_t p = firstWorker; p < parallelism; p++) {
+        startWorker(workers[p], prefaultThreadMemory, (void *)(f + p));
+    }
+    if(firstWorker != 0) {
+        prefaultThreadMemory((void *)f);
+    }
+    for(uint32_t p = firstWorker; p < parallelism; p++) {
+        waitForWorker(workers[p]);
+        releaseWorker(workers[p]);
+    }
+    return true;
 }
 
 // Hash memory for one level of garlic.
@@ -494,10 +641,9 @@ static bool hashMemory(TwoCats_H *H, uint32_t *hash32, uint32_t *mem, uint8_t me
     uint32_t blocklen = blockSize/sizeof(uint32_t);
     uint32_t subBlocklen = subBlockSize/sizeof(uint32_t);
     uint32_t blocksPerThread = TWOCATS_SLICES*(memlen/(TWOCATS_SLICES * parallelism * blocklen));
-
+    uint64_t levelStart = TwoCats_GetNanoseconds();
 
     // Fill out the common constant data used in all threads
-    pthread_t memThreads[parallelism];
     struct TwoCatsContextStruct c[parallelism];
     struct TwoCatsCommonDataStruct common;
     common.multiplies = multiplies;
@@ -508,47 +654,102 @@ static bool hashMemory(TwoCats_H *H, uint32_t *hash32, uint32_t *mem, uint8_t me
     common.subBlocklen = subBlocklen;
     common.blocksPerThread = blocksPerThread;
     common.parallelism = parallelism;
+    common.resistantSlices = resistantSlices;
+    TwoCats_Implementation impl = TwoCats_GetImplementation();
+    common.hashBlocks = findHashBlocksFuncs[impl](subBlocklen, multiplies, lanes);
+    common.hashBlocksResistant = findHashBlocksFuncs[impl](blocklen, multiplies, lanes);
+    common.hashBlocksStreaming = findHashBlocksStreamingFuncs[impl](subBlocklen, multiplies,
+        lanes);
+    common.hashBlocksStreamingResistant = findHashBlocksStreamingFuncs[impl](blocklen,
+        multiplies, lanes);
+    common.streaming = TwoCats_UseStreamingStores(memlen*sizeof(uint32_t));
+    pthread_once(&scheduleOnce, initSchedule);
+
+    // Report the level to the event callback, if there is one
+    common.callback = TwoCats_GetEventCallback(&common.userData);
+    TwoCats_Event levelEvent = {TWOCATS_EVENT_LEVEL_BEGIN, memCost, multiplies, lanes,
+        parallelism, 0, 0, resistantSlices == TWOCATS_SLICES,
+        (uint64_t)blocksPerThread*parallelism*blockSize};
+    common.levelEvent = levelEvent;
+    if(common.callback != NULL) {
+        common.callback(&levelEvent, common.userData);
+    }
+    TWOCATS_PROBE4(level__start, memCost, lanes, parallelism, resistantSlices);
+
+    // When streaming, each thread keeps copies of its last two blocks
+    uint32_t *prevBlocks = NULL;
+    if(common.streaming && posix_memalign((void *)&prevBlocks, 64,
+            (uint64_t)2*blocklen*parallelism*sizeof(uint32_t))) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return false;
+    }
+    common.threads = c;
+    TwoCats_Stats *stats = TwoCats_GetThreadStats();
+    TwoCats_AddStat(&stats->levels, 1);
+    TwoCats_AddStat(&stats->bytesHashed, (uint64_t)blocksPerThread*parallelism*blockSize);
+    TwoCats_AddStat(&stats->hashStateCalls, (uint64_t)(blocksPerThread - 1)*parallelism);
 
     // Initialize thread states
+    uint64_t start = TwoCats_GetNanoseconds();
     uint32_t states[H->len*parallelism];
     H->ExpandUint32(H, states, H->len*parallelism, hash32);
     for(uint32_t p = 0; p < parallelism; p++) {
         c[p].common = &common;
         c[p].p = p;
         c[p].state = states + p*H->len;
+        c[p].blocksDone = 0;
+        c[p].prevBlocks = prevBlocks == NULL? NULL : prevBlocks + (uint64_t)2*blocklen*p;
         TwoCats_InitHash(&(c[p].H), H->type);
     }
-
-    for(uint32_t slice = 0; slice < TWOCATS_SLICES; slice++) {
-        common.completedBlocks = slice*blocksPerThread/TWOCATS_SLICES;
-        for(uint32_t p = 0; p < parallelism; p++) {
-            int rc;
-            if(slice < resistantSlices) {
-                rc = pthread_create(&memThreads[p], NULL, hashWithoutPassword, (void *)(c + p));
-            } else {
-                rc = pthread_create(&memThreads[p], NULL, hashWithPassword, (void *)(c + p));
-            }
-            if(rc) {
-                fprintf(stderr, "Unable to start threads\n");
-                return false;
-            }
-        }
-        for(uint32_t p = 0; p < parallelism; p++) {
-            (void)pthread_join(memThreads[p], NULL);
-        }
+    TwoCats_AddStat(&stats->expansionNanoseconds, TwoCats_GetNanoseconds() - start);
+
+    // The calling thread hashes thread 0's memory, and pool workers do the rest, unless
+    // threads are pinned, in which case workers do it all
+    struct TwoCatsWorkerStruct *workers[parallelism];
+    uint32_t firstWorker = threadsArePinned()? 0 : 1;
+    if(!acquireWorkers(workers, firstWorker, parallelism)) {
+        free(prevBlocks);
+        return false;
+    }
+    for(uint32_t p = firstWorker; p < parallelism; p++) {
+        startWorker(workers[p], hashThreadMemory, (void *)(c + p));
+    }
+    if(firstWorker != 0) {
+        hashThreadMemory((void *)c);
+    }
+    start = TwoCats_GetNanoseconds();
+    for(uint32_t p = firstWorker; p < parallelism; p++) {
+        waitForWorker(workers[p]);
+        releaseWorker(workers[p]);
     }
+    TwoCats_AddStat(&stats->waitNanoseconds, TwoCats_GetNanoseconds() - start);
+    free(prevBlocks);
 
     // Apply a crypto-strength hash
+    start = TwoCats_GetNanoseconds();
     addIntoHash(H, hash32, parallelism, states);
     H->Hash(H, hash32);
+    uint64_t end = TwoCats_GetNanoseconds();
+    TwoCats_AddStat(&stats->finalHashNanoseconds, end - start);
+    TwoCats_Trace(TWOCATS_TRACE_FINALHASH, start, end, memCost, 0, 0);
+    TwoCats_Trace(TWOCATS_TRACE_HASHMEMORY, levelStart, end, memCost, 0, 0);
+    TWOCATS_PROBE4(level__done, memCost, lanes, parallelism, resistantSlices);
+    if(common.callback != NULL) {
+        levelEvent.type = TWOCATS_EVENT_LEVEL_END;
+        common.callback(&levelEvent, common.userData);
+    }
     return true;
 }
 
-// The TwoCats password hashing function.  Return false if there is a memory allocation error.
-bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost, uint8_t stopMemCost,
+// Hash the password through every level of garlic.  Return false if there is a memory
+// allocation error.
+static bool hashPassword(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost, uint8_t stopMemCost,
         uint8_t multiplies, uint8_t lanes, uint8_t parallelism, uint32_t blockSize,
         uint32_t subBlockSize, uint8_t overwriteCost, bool sideChannelResistant) {
 
+    TwoCats_Stats *stats = TwoCats_GetThreadStats();
+    TwoCats_AddStat(&stats->hashes, 1);
+
     // Allocate memory
     uint32_t *mem;
     if(memory != NULL) {
@@ -558,10 +759,25 @@ bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
         }
         mem = memory;
     } else {
+        TWOCATS_PROBE4(alloc__start, stopMemCost, lanes, parallelism,
+            (uint64_t)1024 << stopMemCost);
+        uint64_t start = TwoCats_GetNanoseconds();
         if(posix_memalign((void *)&mem,  64, (uint64_t)1024 << stopMemCost)) {
             fprintf(stderr, "Unable to allocate memory\n");
             return false;
         }
+        // Lower garlic levels only use the start of memory, so without this, all of it
+        // would be first touched by the threads hashing the lowest levels
+        if(threadsArePinned() &&
+                !TwoCats_PrefaultMemory(mem, (uint64_t)1024 << stopMemCost, parallelism)) {
+            free(mem);
+            return false;
+        }
+        uint64_t end = TwoCats_GetNanoseconds();
+        TwoCats_AddStat(&stats->allocationNanoseconds, end - start);
+        TwoCats_Trace(TWOCATS_TRACE_ALLOCATE, start, end, stopMemCost, 0, 0);
+        TWOCATS_PROBE4(alloc__done, stopMemCost, lanes, parallelism,
+            (uint64_t)1024 << stopMemCost);
     }
 
     // Iterate through the levels of garlic.  Throw away some early memory to reduce the
@@ -575,14 +791,22 @@ bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
                 }
                 if(!hashMemory(H, hash32, mem, i, multiplies, lanes, parallelism,
                         blockSize, subBlockSize, resistantSlices)) {
-                    free(mem);
+                    if(memory == NULL) {
+                        free(mem);
+                    }
                     return false;
                 }
             }
             // Not doing the last hash is for server relief support
-            if(i != stopMemCost && !H->Hash(H, hash32)) {
-                free(mem);
-                return false;
+            if(i != stopMemCost) {
+                uint64_t start = TwoCats_GetNanoseconds();
+                if(!H->Hash(H, hash32)) {
+                    if(memory == NULL) {
+                        free(mem);
+                    }
+                    return false;
+                }
+                TwoCats_AddStat(&stats->levelHashNanoseconds, TwoCats_GetNanoseconds() - start);
             }
         }
     }
@@ -593,3 +817,154 @@ bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
     }
     return true;
 }
+
+// The TwoCats password hashing function.  Return false if there is a memory allocation error.
+bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost, uint8_t stopMemCost,
+        uint8_t multiplies, uint8_t lanes, uint8_t parallelism, uint32_t blockSize,
+        uint32_t subBlockSize, uint8_t overwriteCost, bool sideChannelResistant) {
+    TWOCATS_PROBE4(hash__start, stopMemCost, lanes, parallelism, startMemCost);
+    bool result = hashPassword(memory, H, hash32, startMemCost, stopMemCost, multiplies, lanes,
+        parallelism, blockSize, subBlockSize, overwriteCost, sideChannelResistant);
+    TWOCATS_PROBE5(hash__done, stopMemCost, lanes, parallelism, startMemCost, result);
+    return result;
+}
+
+// Hash one level of garlic for a batch of hashes with parallelism 1.  This does the same
+// as hashMemory for each hash, but a block at a time for all of them, so that their
+// Blake2s compressions can run together.
+static void hashBatchMemory(struct TwoCatsBatchStruct *b, uint8_t memCost,
+        uint32_t resistantSlices) {
+
+    uint64_t memlen = (1024/sizeof(uint32_t)) << memCost;
+    uint32_t blocklen = b->blocklen;
+    uint32_t blocksPerThread = TWOCATS_SLICES*(memlen/(TWOCATS_SLICES*blocklen));
+    uint32_t values[TWOCATS_BATCHWIDTH] = {0};
+    uint32_t *outs[TWOCATS_BATCHWIDTH];
+
+    // Initialize the states, and the first block of memory
+    for(uint32_t k = 0; k < TWOCATS_BATCHWIDTH; k++) {
+        memcpy(b->states[k], b->hash32s[k < b->numHashes? k : 0], 8*sizeof(uint32_t));
+    }
+    b->hashStates8(b->states, values);
+    for(uint32_t j = 0; j < blocklen/8; j++) {
+        for(uint32_t k = 0; k < TWOCATS_BATCHWIDTH; k++) {
+            outs[k] = k < b->numHashes? b->mems[k] + j*8 : b->states[k];
+            if(k < b->numHashes) {
+                memcpy(outs[k], b->states[k], 8*sizeof(uint32_t));
+            }
+            values[k] = j;
+        }
+        b->hashStates8(outs, values);
+    }
+
+    for(uint32_t i = 1; i < blocksPerThread; i++) {
+        uint32_t slice = i/(blocksPerThread/TWOCATS_SLICES);
+        uint64_t toAddr = i*blocklen;
+        uint64_t prevAddr = toAddr - blocklen;
+        if(slice < resistantSlices) {
+            // The "sliding reverse" block position is the same for every hash
+            uint64_t fromAddr = blocklen*(uint64_t)slidingReverse(i);
+            for(uint32_t k = 0; k < b->numHashes; k++) {
+                values[k] = b->hashBlocksResistant(b->states[k], b->mems[k], blocklen, blocklen,
+                    fromAddr, prevAddr, toAddr, b->multiplies, b->lanes);
+            }
+        } else {
+            for(uint32_t k = 0; k < b->numHashes; k++) {
+                // Compute rand()^3 distance distribution
+                uint64_t v = b->states[k][0];
+                uint64_t v2 = v*v >> 32;
+                uint64_t v3 = v*v2 >> 32;
+                uint32_t distance = (i-1)*v3 >> 32;
+                uint64_t fromAddr = (i - 1 - distance)*(uint64_t)blocklen;
+                values[k] = b->hashBlocks(b->states[k], b->mems[k], blocklen, b->subBlocklen,
+                    fromAddr, prevAddr, toAddr, b->multiplies, b->lanes);
+            }
+        }
+        b->hashStates8(b->states, values);
+    }
+
+    // Apply a crypto-strength hash
+    for(uint32_t k = 0; k < b->numHashes; k++) {
+        addIntoHash(b->H, b->hash32s[k], 1, b->states[k]);
+        b->H->Hash(b->H, b->hash32s[k]);
+    }
+}
+
+// Run TwoCats on numHashes independent hashes with the same parameters.  With Blake2s,
+// parallelism 1, and memory that fits in the cache, run up to 8 at a time in lock-step, so that HashState, which is most of
+// the work for small memCost, can do 8 Blake2s compressions at once.  Otherwise, just
+// hash them one at a time.
+bool TwoCats_Batch(TwoCats_H *H, uint32_t **hash32s, uint32_t numHashes, uint8_t startMemCost,
+        uint8_t stopMemCost, uint8_t multiplies, uint8_t lanes, uint8_t parallelism,
+        uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost, bool sideChannelResistant) {
+
+    // Once the hashes' memory spills out of the cache, hashing is bound by memory
+    // bandwidth, and lock-step only multiplies the memory used
+    uint64_t maxMem = TwoCats_GetLastLevelCacheSize();
+    if(maxMem == 0) {
+        maxMem = TWOCATS_BATCHMAXMEM;
+    }
+    if(H->type != TWOCATS_BLAKE2S || parallelism != 1 || numHashes < 2 ||
+            TWOCATS_BATCHWIDTH*((uint64_t)1024 << stopMemCost) > maxMem) {
+        for(uint32_t i = 0; i < numHashes; i++) {
+            if(!TwoCats(NULL, H, hash32s[i], startMemCost, stopMemCost, multiplies, lanes,
+                    parallelism, blockSize, subBlockSize, overwriteCost, sideChannelResistant)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct TwoCatsBatchStruct b;
+    TwoCats_Implementation impl = TwoCats_GetImplementation();
+    b.H = H;
+    b.blocklen = blockSize/sizeof(uint32_t);
+    b.subBlocklen = subBlockSize/sizeof(uint32_t);
+    b.multiplies = multiplies;
+    b.lanes = lanes;
+    b.hashBlocks = findHashBlocksFuncs[impl](b.subBlocklen, multiplies, lanes);
+    b.hashBlocksResistant = findHashBlocksFuncs[impl](b.blocklen, multiplies, lanes);
+    b.hashStates8 = hashStates8Funcs[impl];
+    pthread_once(&scheduleOnce, initSchedule);
+    uint32_t stateBuf[TWOCATS_BATCHWIDTH][8];
+    uint32_t numMems = numHashes < TWOCATS_BATCHWIDTH? numHashes : TWOCATS_BATCHWIDTH;
+    uint64_t memSize = (uint64_t)1024 << stopMemCost;
+    uint32_t *mem;
+    if(posix_memalign((void *)&mem, 64, numMems*memSize)) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return false;
+    }
+    for(uint32_t k = 0; k < TWOCATS_BATCHWIDTH; k++) {
+        b.states[k] = stateBuf[k];
+        b.mems[k] = k < numMems? mem + k*memSize/sizeof(uint32_t) : NULL;
+    }
+
+    for(uint32_t first = 0; first < numHashes; first += TWOCATS_BATCHWIDTH) {
+        b.numHashes = numHashes - first < TWOCATS_BATCHWIDTH? numHashes - first : TWOCATS_BATCHWIDTH;
+        for(uint32_t k = 0; k < b.numHashes; k++) {
+            b.hash32s[k] = hash32s[first + k];
+        }
+
+        // Iterate through the levels of garlic, the same as TwoCats
+        for(uint8_t i = 0; i <= stopMemCost; i++) {
+            if(i >= startMemCost || i < overwriteCost) {
+                if(((uint64_t)1024 << i)/blockSize >= TWOCATS_SLICES) {
+                    uint32_t resistantSlices = TWOCATS_SLICES/2;
+                    if(i < startMemCost || sideChannelResistant) {
+                        resistantSlices = TWOCATS_SLICES;
+                    }
+                    hashBatchMemory(&b, i, resistantSlices);
+                }
+                // Not doing the last hash is for server relief support
+                for(uint32_t k = 0; k < b.numHashes && i != stopMemCost; k++) {
+                    if(!H->Hash(H, b.hash32s[k])) {
+                        free(mem);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    free(mem);
+    return true;
+}
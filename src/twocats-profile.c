@@ -0,0 +1,169 @@
+/*
+   TwoCats tuning profiles, which set the parameters TwoCats_HashPasswordFull uses.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "twocats-internal.h"
+
+// Hashing threads read the profile while others may load or set it, so it is only read or
+// written with profileMutex held, and a hash never sees half of an update.
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+static TwoCats_Parameters profile[TWOCATS_NONE];
+static bool inProfile[TWOCATS_NONE];
+static bool profileFailed = false;
+
+// Load the profile named by the environment when the library loads, so every hash in the
+// process uses the same one.
+static void __attribute__((constructor)) loadEnvironmentProfile(void) {
+    char *path = getenv(TWOCATS_PROFILE_ENV);
+    if(path != NULL && *path != '\0' && !TwoCats_LoadProfile(path)) {
+        profileFailed = true;
+    }
+}
+
+// Return true if x is a power of 2.
+static bool isPowerOf2(uint32_t x) {
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+// Check that the settings are ones TwoCats_HashPasswordExtended accepts.
+static bool validSettings(const TwoCats_Parameters *params) {
+    if(params->hashType >= TWOCATS_NONE) {
+        return false;
+    }
+    uint32_t len = TwoCats_GetHashTypeSize(params->hashType)/sizeof(uint32_t);
+    return params->lanes >= 1 && params->lanes <= len && params->multiplies <= 8 &&
+        isPowerOf2(params->blockSize) && params->blockSize >= 32 &&
+        params->blockSize <= (1 << 20) && isPowerOf2(params->subBlockSize) &&
+        params->subBlockSize >= 4*params->lanes && params->subBlockSize <= params->blockSize;
+}
+
+// Read a profile.  On success, it replaces the current one.  Return false if the file
+// can't be read, is a different version, or has invalid settings.
+bool TwoCats_LoadProfile(const char *path) {
+    FILE *file = fopen(path, "r");
+    if(file == NULL) {
+        fprintf(stderr, "Unable to open tuning profile %s\n", path);
+        return false;
+    }
+    TwoCats_Parameters newProfile[TWOCATS_NONE];
+    bool newInProfile[TWOCATS_NONE] = {false};
+    bool haveVersion = false;
+    char line[256];
+    uint32_t lineNum = 0;
+    while(fgets(line, sizeof(line), file) != NULL) {
+        lineNum++;
+        char name[32];
+        unsigned version, lanes, multiplies, blockSize, subBlockSize;
+        if(line[0] == '#' || sscanf(line, "%31s", name) != 1) {
+            continue; // Comment or blank line
+        }
+        if(!haveVersion) {
+            if(sscanf(line, "version %u", &version) != 1 || version != TWOCATS_PROFILE_VERSION) {
+                fprintf(stderr, "%s:%u: expected version %u\n", path, lineNum,
+                    TWOCATS_PROFILE_VERSION);
+                fclose(file);
+                return false;
+            }
+            haveVersion = true;
+            continue;
+        }
+        TwoCats_Parameters params = {TwoCats_FindHashType(name), 0, 0, 0, 0, 0, 0, 0.0, 0.0};
+        if(sscanf(line, "%31s %u %u %u %u", name, &lanes, &multiplies, &blockSize,
+                &subBlockSize) != 5 || lanes > 255 || multiplies > 255) {
+            fprintf(stderr, "%s:%u: expected hashType lanes multiplies blockSize subBlockSize\n",
+                path, lineNum);
+            fclose(file);
+            return false;
+        }
+        params.lanes = lanes;
+        params.multiplies = multiplies;
+        params.blockSize = blockSize;
+        params.subBlockSize = subBlockSize;
+        if(!validSettings(&params)) {
+            fprintf(stderr, "%s:%u: invalid settings for %s\n", path, lineNum, name);
+            fclose(file);
+            return false;
+        }
+        newProfile[params.hashType] = params;
+        newInProfile[params.hashType] = true;
+    }
+    fclose(file);
+    if(!haveVersion) {
+        fprintf(stderr, "%s: empty tuning profile\n", path);
+        return false;
+    }
+    pthread_mutex_lock(&profileMutex);
+    memcpy(profile, newProfile, sizeof(profile));
+    memcpy(inProfile, newInProfile, sizeof(inProfile));
+    profileFailed = false;
+    pthread_mutex_unlock(&profileMutex);
+    return true;
+}
+
+// Write the current profile.  Return false if the file can't be written.
+bool TwoCats_SaveProfile(const char *path) {
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        fprintf(stderr, "Unable to write tuning profile %s\n", path);
+        return false;
+    }
+    fprintf(file, "# TwoCats tuning profile.  These settings are part of every hash\n"
+        "# TwoCats_HashPasswordFull computes with this profile.\n"
+        "version %u\n"
+        "# hashType lanes multiplies blockSize subBlockSize\n", TWOCATS_PROFILE_VERSION);
+    for(uint32_t hashType = 0; hashType < TWOCATS_NONE; hashType++) {
+        TwoCats_Parameters params;
+        if(TwoCats_GetProfileParameters(hashType, &params)) {
+            fprintf(file, "%s %u %u %u %u\n", TwoCats_GetHashTypeName(hashType),
+                params.lanes, params.multiplies, params.blockSize, params.subBlockSize);
+        }
+    }
+    return fclose(file) == 0;
+}
+
+// Set the profile's settings for params->hashType.  Return false if they are invalid.
+bool TwoCats_SetProfileParameters(const TwoCats_Parameters *params) {
+    if(!validSettings(params)) {
+        return false;
+    }
+    pthread_mutex_lock(&profileMutex);
+    profile[params->hashType] = *params;
+    inProfile[params->hashType] = true;
+    pthread_mutex_unlock(&profileMutex);
+    return true;
+}
+
+// Find the profile's settings for the hash type.  Return false if it has none.
+bool TwoCats_GetProfileParameters(TwoCats_HashType hashType, TwoCats_Parameters *params) {
+    if(hashType >= TWOCATS_NONE) {
+        return false;
+    }
+    pthread_mutex_lock(&profileMutex);
+    bool found = inProfile[hashType];
+    if(found) {
+        *params = profile[hashType];
+    }
+    pthread_mutex_unlock(&profileMutex);
+    return found;
+}
+
+// Return true if TWOCATS_PROFILE names a profile we could not load.
+bool TwoCats_ProfileFailed(void) {
+    pthread_mutex_lock(&profileMutex);
+    bool failed = profileFailed;
+    pthread_mutex_unlock(&profileMutex);
+    return failed;
+}
@@ -155,6 +155,22 @@ static bool hashWithPassword(TwoCats_H *H, uint32_t *state, uint32_t *mem, uint3
     return true;
 }
 
+// Report the start or end of one thread's slice to the event callback, if there is one.
+// The other fields come from the level's event.
+static void reportSlice(TwoCats_EventCallback callback, void *userData,
+        const TwoCats_Event *levelEvent, TwoCats_EventType type, uint32_t p, uint32_t slice,
+        uint32_t resistantSlices, uint64_t bytes) {
+    if(callback != NULL) {
+        TwoCats_Event event = *levelEvent;
+        event.type = type;
+        event.thread = p;
+        event.slice = slice;
+        event.resistant = slice < resistantSlices;
+        event.bytes = bytes;
+        callback(&event, userData);
+    }
+}
+
 // Hash memory for one level of garlic.
 static bool hashMemory(TwoCats_H *H, uint32_t *hash32, uint32_t *mem, uint8_t memCost,
         uint8_t multiplies, uint8_t lanes, uint8_t parallelism, uint32_t blockSize,
@@ -164,15 +180,38 @@ static bool hashMemory(TwoCats_H *H, uint32_t *hash32, uint32_t *mem, uint8_t me
     uint32_t blocklen = blockSize/sizeof(uint32_t);
     uint32_t subBlocklen = subBlockSize/sizeof(uint32_t);
     uint32_t blocksPerThread = TWOCATS_SLICES*(memlen/(TWOCATS_SLICES * parallelism * blocklen));
+    uint64_t sliceBytes = (uint64_t)blocksPerThread/TWOCATS_SLICES*blockSize;
+    uint64_t levelStart = TwoCats_GetNanoseconds();
+
+    // Report the level to the event callback, if there is one
+    void *userData;
+    TwoCats_EventCallback callback = TwoCats_GetEventCallback(&userData);
+    TwoCats_Event levelEvent = {TWOCATS_EVENT_LEVEL_BEGIN, memCost, multiplies, lanes,
+        parallelism, 0, 0, resistantSlices == TWOCATS_SLICES,
+        sliceBytes*TWOCATS_SLICES*parallelism};
+    if(callback != NULL) {
+        callback(&levelEvent, userData);
+    }
+    TWOCATS_PROBE4(level__start, memCost, lanes, parallelism, resistantSlices);
+    TwoCats_Stats *stats = TwoCats_GetThreadStats();
+    TwoCats_AddStat(&stats->levels, 1);
+    TwoCats_AddStat(&stats->bytesHashed, levelEvent.bytes);
+    TwoCats_AddStat(&stats->hashStateCalls, (uint64_t)(blocksPerThread - 1)*parallelism);
 
     // Initialize thread states
+    uint64_t start = TwoCats_GetNanoseconds();
     uint32_t states[H->len*parallelism];
     if(!H->ExpandUint32(H, states, H->len*parallelism, hash32)) {
         return false;
     }
+    TwoCats_AddStat(&stats->expansionNanoseconds, TwoCats_GetNanoseconds() - start);
 
     for(uint32_t slice = 0; slice < TWOCATS_SLICES; slice++) {
         for(uint32_t p = 0; p < parallelism; p++) {
+            reportSlice(callback, userData, &levelEvent, TWOCATS_EVENT_SLICE_BEGIN, p, slice,
+                resistantSlices, sliceBytes);
+            TWOCATS_PROBE5(slice__start, memCost, lanes, parallelism, p, slice);
+            start = TwoCats_GetNanoseconds();
             if(slice < resistantSlices) {
                 if(!hashWithoutPassword(H, states + p*H->len, mem, p, blocklen, blocksPerThread, multiplies,
                         lanes, parallelism, slice*blocksPerThread/TWOCATS_SLICES)) {
@@ -184,18 +223,59 @@ static bool hashMemory(TwoCats_H *H, uint32_t *hash32, uint32_t *mem, uint8_t me
                     return false;
                 }
             }
+            uint64_t end = TwoCats_GetNanoseconds();
+            if(slice < resistantSlices) {
+                TwoCats_AddStat(&stats->resistantNanoseconds, end - start);
+                TwoCats_Trace(TWOCATS_TRACE_RESISTANT, start, end, memCost, slice, p);
+            } else {
+                TwoCats_AddStat(&stats->passwordNanoseconds, end - start);
+                TwoCats_Trace(TWOCATS_TRACE_PASSWORD, start, end, memCost, slice, p);
+            }
+            TWOCATS_PROBE5(slice__done, memCost, lanes, parallelism, p, slice);
+            reportSlice(callback, userData, &levelEvent, TWOCATS_EVENT_SLICE_END, p, slice,
+                resistantSlices, sliceBytes);
         }
     }
 
+    start = TwoCats_GetNanoseconds();
     addIntoHash(H, hash32, parallelism, states);
-    return H->Hash(H, hash32);
+    if(!H->Hash(H, hash32)) {
+        return false;
+    }
+    uint64_t end = TwoCats_GetNanoseconds();
+    TwoCats_AddStat(&stats->finalHashNanoseconds, end - start);
+    TwoCats_Trace(TWOCATS_TRACE_FINALHASH, start, end, memCost, 0, 0);
+    TwoCats_Trace(TWOCATS_TRACE_HASHMEMORY, levelStart, end, memCost, 0, 0);
+    TWOCATS_PROBE4(level__done, memCost, lanes, parallelism, resistantSlices);
+    if(callback != NULL) {
+        levelEvent.type = TWOCATS_EVENT_LEVEL_END;
+        callback(&levelEvent, userData);
+    }
+    return true;
 }
 
-// The TwoCats internal password hashing function.  Return false if there is a memory allocation error.
-bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
+// The reference version hashes on the calling thread, so there are no threads to pin.
+bool TwoCats_SetThreadAffinity(const uint32_t *cpus, uint32_t numCpus) {
+    return true;
+}
+
+// Write to every page of memory so it is faulted in before hashing.
+bool TwoCats_PrefaultMemory(void *memory, uint64_t size, uint8_t parallelism) {
+    volatile uint8_t *mem = memory;
+    for(uint64_t i = 0; i < size; i += TWOCATS_PAGESIZE) {
+        mem[i] = 0;
+    }
+    return true;
+}
+
+// Hash the password through every level of garlic.
+static bool hashPassword(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
         uint8_t stopMemCost, uint8_t multiplies, uint8_t lanes, uint8_t parallelism,
         uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost, bool sideChannelResistant) {
 
+    TwoCats_Stats *stats = TwoCats_GetThreadStats();
+    TwoCats_AddStat(&stats->hashes, 1);
+
     // Allocate memory
     uint32_t *mem;
     if(memory != NULL) {
@@ -205,11 +285,19 @@ bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
         }
         mem = memory;
     } else {
+        TWOCATS_PROBE4(alloc__start, stopMemCost, lanes, parallelism,
+            (uint64_t)1024 << stopMemCost);
+        uint64_t start = TwoCats_GetNanoseconds();
         mem = malloc((uint64_t)1024 << stopMemCost);
         if(mem == NULL) {
             fprintf(stderr, "Unable to allocate memory\n");
             return false;
         }
+        uint64_t end = TwoCats_GetNanoseconds();
+        TwoCats_AddStat(&stats->allocationNanoseconds, end - start);
+        TwoCats_Trace(TWOCATS_TRACE_ALLOCATE, start, end, stopMemCost, 0, 0);
+        TWOCATS_PROBE4(alloc__done, stopMemCost, lanes, parallelism,
+            (uint64_t)1024 << stopMemCost);
     }
 
     // Iterate through the levels of garlic.  Throw away some early memory to reduce the
@@ -223,12 +311,22 @@ bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
                 }
                 if(!hashMemory(H, hash32, mem, i, multiplies, lanes, parallelism,
                         blockSize, subBlockSize, resistantSlices)) {
+                    if(memory == NULL) {
+                        free(mem);
+                    }
                     return false;
                 }
             }
             // Not doing the last hash is for server relief support
-            if(i != stopMemCost && !H->Hash(H, hash32)) {
-                return false;
+            if(i != stopMemCost) {
+                uint64_t start = TwoCats_GetNanoseconds();
+                if(!H->Hash(H, hash32)) {
+                    if(memory == NULL) {
+                        free(mem);
+                    }
+                    return false;
+                }
+                TwoCats_AddStat(&stats->levelHashNanoseconds, TwoCats_GetNanoseconds() - start);
             }
         }
     }
@@ -240,3 +338,27 @@ bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
     }
     return true;
 }
+
+// The TwoCats internal password hashing function.  Return false if there is a memory allocation error.
+bool TwoCats(void *memory, TwoCats_H *H, uint32_t *hash32, uint8_t startMemCost,
+        uint8_t stopMemCost, uint8_t multiplies, uint8_t lanes, uint8_t parallelism,
+        uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost, bool sideChannelResistant) {
+    TWOCATS_PROBE4(hash__start, stopMemCost, lanes, parallelism, startMemCost);
+    bool result = hashPassword(memory, H, hash32, startMemCost, stopMemCost, multiplies, lanes,
+        parallelism, blockSize, subBlockSize, overwriteCost, sideChannelResistant);
+    TWOCATS_PROBE5(hash__done, stopMemCost, lanes, parallelism, startMemCost, result);
+    return result;
+}
+
+// Run TwoCats on numHashes independent hashes with the same parameters, one at a time.
+bool TwoCats_Batch(TwoCats_H *H, uint32_t **hash32s, uint32_t numHashes, uint8_t startMemCost,
+        uint8_t stopMemCost, uint8_t multiplies, uint8_t lanes, uint8_t parallelism,
+        uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost, bool sideChannelResistant) {
+    for(uint32_t i = 0; i < numHashes; i++) {
+        if(!TwoCats(NULL, H, hash32s[i], startMemCost, stopMemCost, multiplies, lanes,
+                parallelism, blockSize, subBlockSize, overwriteCost, sideChannelResistant)) {
+            return false;
+        }
+    }
+    return true;
+}
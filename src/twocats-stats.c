@@ -0,0 +1,130 @@
+/*
+   TwoCats runtime statistics, kept per thread and added up when read.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// Needed for clock_gettime with -std=c99
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "twocats-internal.h"
+
+// Every field of TwoCats_Stats is a uint64_t, so we can add them up as an array.
+#define TWOCATS_NUMSTATS (sizeof(TwoCats_Stats)/sizeof(uint64_t))
+
+// Each thread that hashes gets one of these the first time it adds to a statistic.  Only
+// that thread writes it, so it needs no locking, and others read it with relaxed loads.
+struct TwoCatsThreadStatsStruct {
+    TwoCats_Stats stats;
+    struct TwoCatsThreadStatsStruct *next;
+    struct TwoCatsThreadStatsStruct *prev;
+};
+
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t statsKey;
+static struct TwoCatsThreadStatsStruct *threadStatsList = NULL;
+// Statistics from threads that have exited, and the totals when last reset.
+static TwoCats_Stats exitedStats;
+static TwoCats_Stats resetStats;
+static __thread struct TwoCatsThreadStatsStruct *threadStats = NULL;
+
+// Add a thread's statistics into totals.
+static void addStats(TwoCats_Stats *totals, TwoCats_Stats *stats) {
+    uint64_t *total = (uint64_t *)totals;
+    uint64_t *value = (uint64_t *)stats;
+    for(uint32_t i = 0; i < TWOCATS_NUMSTATS; i++) {
+        total[i] += __atomic_load_n(value + i, __ATOMIC_RELAXED);
+    }
+}
+
+// When a thread exits, keep its statistics in exitedStats, and free its block.
+static void freeThreadStats(void *threadStatsPtr) {
+    struct TwoCatsThreadStatsStruct *s = (struct TwoCatsThreadStatsStruct *)threadStatsPtr;
+    pthread_mutex_lock(&statsMutex);
+    addStats(&exitedStats, &s->stats);
+    if(s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        threadStatsList = s->next;
+    }
+    if(s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    pthread_mutex_unlock(&statsMutex);
+    free(s);
+}
+
+static void initStatsKey(void) {
+    pthread_key_create(&statsKey, freeThreadStats);
+}
+
+// Return this thread's statistics.  If we are out of memory, return a scratch block that
+// is never read, so callers need not check.
+TwoCats_Stats *TwoCats_GetThreadStats(void) {
+    static TwoCats_Stats uncountedStats;
+    if(threadStats != NULL) {
+        return &threadStats->stats;
+    }
+    pthread_once(&statsOnce, initStatsKey);
+    struct TwoCatsThreadStatsStruct *s = calloc(1, sizeof(struct TwoCatsThreadStatsStruct));
+    if(s == NULL) {
+        return &uncountedStats;
+    }
+    pthread_mutex_lock(&statsMutex);
+    s->next = threadStatsList;
+    if(threadStatsList != NULL) {
+        threadStatsList->prev = s;
+    }
+    threadStatsList = s;
+    pthread_mutex_unlock(&statsMutex);
+    pthread_setspecific(statsKey, s);
+    threadStats = s;
+    return &s->stats;
+}
+
+// Add up every thread's statistics since the library loaded.  Call with statsMutex held.
+static void getTotalStats(TwoCats_Stats *totals) {
+    memcpy(totals, &exitedStats, sizeof(TwoCats_Stats));
+    for(struct TwoCatsThreadStatsStruct *s = threadStatsList; s != NULL; s = s->next) {
+        addStats(totals, &s->stats);
+    }
+}
+
+// Add up every thread's statistics since the last reset.
+void TwoCats_GetStats(TwoCats_Stats *stats) {
+    pthread_mutex_lock(&statsMutex);
+    getTotalStats(stats);
+    uint64_t *total = (uint64_t *)stats;
+    uint64_t *reset = (uint64_t *)&resetStats;
+    for(uint32_t i = 0; i < TWOCATS_NUMSTATS; i++) {
+        total[i] -= reset[i];
+    }
+    pthread_mutex_unlock(&statsMutex);
+}
+
+// Start counting from 0 again.  The per-thread counters only ever grow, so rather than
+// clearing counters other threads are writing, remember the current totals.
+void TwoCats_ResetStats(void) {
+    pthread_mutex_lock(&statsMutex);
+    getTotalStats(&resetStats);
+    pthread_mutex_unlock(&statsMutex);
+}
+
+// Return a monotonic time in nanoseconds, for timing the phases of hashing.
+uint64_t TwoCats_GetNanoseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*(uint64_t)1000000000 + t.tv_nsec;
+}
@@ -10,6 +10,369 @@
 #include "twocats-internal.h"
 
 #define TEST_MEMCOST 10
+// Batches of 8 hashes must fit in the cache to be hashed in lock-step
+#define BATCH_MEMCOST 8
+
+// Every implementation must compute the same hashes, for each lane count the kernels
+// have special code for.
+void verifyImplementations(TwoCats_HashType hashType) {
+    uint32_t keySize = TwoCats_GetHashTypeSize(hashType);
+    TwoCats_Implementation defaultImpl = TwoCats_GetImplementation();
+    for(uint8_t lanes = 1; lanes <= keySize/4; lanes <<= 1) {
+        for(uint32_t resistant = 0; resistant < 2; resistant++) {
+            uint8_t hash1[keySize], hash2[keySize];
+            for(TwoCats_Implementation impl = 0; impl < TWOCATS_IMPL_NONE; impl++) {
+                if(!TwoCats_SetImplementation(impl)) {
+                    continue;
+                }
+                uint8_t password[8];
+                memcpy(password, "password", 8);
+                uint8_t salt[4];
+                memcpy(salt, "salt", 4);
+                uint8_t *hash = impl == TWOCATS_IMPL_GENERIC? hash1 : hash2;
+                if(!TwoCats_HashPasswordExtended(NULL, hashType, hash, password, 8,
+                        salt, 4, NULL, 0, 0, TEST_MEMCOST, TWOCATS_MULTIPLIES,
+                        lanes, TWOCATS_PARALLELISM, TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE,
+                        TWOCATS_OVERWRITECOST, false, resistant)) {
+                    fprintf(stderr, "Password hashing failed!\n");
+                    exit(1);
+                }
+                if(impl != TWOCATS_IMPL_GENERIC && memcmp(hash1, hash2, keySize)) {
+                    fprintf(stderr, "Implementation %s got wrong answer!\n",
+                        TwoCats_GetImplementationName(impl));
+                    exit(1);
+                }
+            }
+        }
+    }
+    TwoCats_SetImplementation(defaultImpl);
+}
+
+// Streaming stores must not change the hashes, with every implementation.  Use several
+// threads, so they read blocks other threads wrote with streaming stores.
+void verifyStoreModes(TwoCats_HashType hashType) {
+    uint32_t keySize = TwoCats_GetHashTypeSize(hashType);
+    TwoCats_StoreMode defaultStoreMode = TwoCats_GetStoreMode();
+    TwoCats_Implementation defaultImpl = TwoCats_GetImplementation();
+    for(TwoCats_Implementation impl = 0; impl < TWOCATS_IMPL_NONE; impl++) {
+        if(!TwoCats_SetImplementation(impl)) {
+            continue;
+        }
+        for(uint8_t lanes = 1; lanes <= keySize/4; lanes <<= 1) {
+            for(uint32_t resistant = 0; resistant < 2; resistant++) {
+                uint8_t hash1[keySize], hash2[keySize];
+                for(uint32_t i = 0; i < 2; i++) {
+                    TwoCats_SetStoreMode(i == 0? TWOCATS_STORES_NORMAL : TWOCATS_STORES_STREAMING);
+                    uint8_t password[8];
+                    memcpy(password, "password", 8);
+                    uint8_t salt[4];
+                    memcpy(salt, "salt", 4);
+                    if(!TwoCats_HashPasswordExtended(NULL, hashType, i == 0? hash1 : hash2,
+                            password, 8, salt, 4, NULL, 0, 0, TEST_MEMCOST, TWOCATS_MULTIPLIES,
+                            lanes, 4, TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE,
+                            TWOCATS_OVERWRITECOST, false, resistant)) {
+                        fprintf(stderr, "Password hashing failed!\n");
+                        exit(1);
+                    }
+                }
+                if(memcmp(hash1, hash2, keySize)) {
+                    fprintf(stderr, "Streaming stores got wrong answer with %s!\n",
+                        TwoCats_GetImplementationName(impl));
+                    exit(1);
+                }
+            }
+        }
+    }
+    TwoCats_SetStoreMode(defaultStoreMode);
+    TwoCats_SetImplementation(defaultImpl);
+}
+
+// Hashing in a context must give the same answer, including when it reuses a buffer.
+// Also reserve several buffers with several threads, so the optimized version splits
+// prefaulting each of them across its workers.
+void verifyContext(TwoCats_HashType hashType) {
+    uint32_t keySize = TwoCats_GetHashTypeSize(hashType);
+    uint8_t hash1[keySize], hash2[keySize];
+    uint8_t parallelisms[2] = {TWOCATS_PARALLELISM, 4};
+    uint32_t numBuffers[2] = {1, 3};
+    for(uint32_t j = 0; j < 2; j++) {
+        uint8_t parallelism = parallelisms[j];
+        TwoCats_PageMode pageMode;
+        TwoCats_Context *context = TwoCats_CreateContext(parallelism, TWOCATS_PAGES_HUGE2M);
+        if(context == NULL || !TwoCats_ReserveContextMemory(context, TEST_MEMCOST,
+                numBuffers[j], &pageMode) || pageMode >= TWOCATS_PAGES_NONE) {
+            fprintf(stderr, "Unable to create context!\n");
+            exit(1);
+        }
+        for(uint32_t i = 0; i < 2 + numBuffers[j]; i++) {
+            uint8_t password[8];
+            memcpy(password, "password", 8);
+            uint8_t salt[4];
+            memcpy(salt, "salt", 4);
+            uint8_t *hash = i == 0? hash1 : hash2;
+            bool result;
+            if(i == 0) {
+                result = TwoCats_HashPasswordExtended(NULL, hashType, hash, password, 8, salt,
+                    4, NULL, 0, TEST_MEMCOST, TEST_MEMCOST, TWOCATS_MULTIPLIES, TWOCATS_LANES,
+                    parallelism, TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE,
+                    TWOCATS_OVERWRITECOST, false, false);
+            } else {
+                result = TwoCats_HashPasswordContext(context, hashType, hash, password, 8, salt,
+                    4, NULL, 0, TEST_MEMCOST, TEST_MEMCOST, TWOCATS_MULTIPLIES, TWOCATS_LANES,
+                    parallelism, TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE,
+                    TWOCATS_OVERWRITECOST, false, false);
+            }
+            if(!result) {
+                fprintf(stderr, "Password hashing failed!\n");
+                exit(1);
+            }
+            if(i != 0 && memcmp(hash1, hash2, keySize)) {
+                fprintf(stderr, "Password context got wrong answer!\n");
+                exit(1);
+            }
+        }
+        TwoCats_FreeContext(context);
+    }
+}
+
+// A batch of hashes must give the same answers as hashing each on its own, with every
+// implementation.  Use a batch size that is not a multiple of 8, and different password
+// lengths.  Use little enough memory that the batch fits in the cache, so it is hashed in
+// lock-step.
+void verifyBatch(TwoCats_HashType hashType) {
+    uint32_t keySize = TwoCats_GetHashTypeSize(hashType);
+    uint8_t hashes[11][keySize], passwords[11][12], salts[11][4];
+    uint8_t *hashPtrs[11], *passwordPtrs[11], *saltPtrs[11];
+    uint32_t passwordSizes[11], saltSizes[11];
+    TwoCats_Implementation defaultImpl = TwoCats_GetImplementation();
+    for(TwoCats_Implementation impl = 0; impl < TWOCATS_IMPL_NONE; impl++) {
+        if(!TwoCats_SetImplementation(impl)) {
+            continue;
+        }
+        for(uint32_t parallelism = 1; parallelism <= 2; parallelism++) {
+            for(uint32_t i = 0; i < 11; i++) {
+                passwordSizes[i] = snprintf((char *)passwords[i], 12, "password%u", i);
+                saltSizes[i] = 4;
+                memcpy(salts[i], "salt", 4);
+                hashPtrs[i] = hashes[i];
+                passwordPtrs[i] = passwords[i];
+                saltPtrs[i] = salts[i];
+            }
+            if(!TwoCats_HashPasswordBatch(hashType, 11, hashPtrs, passwordPtrs, passwordSizes,
+                    saltPtrs, saltSizes, BATCH_MEMCOST, BATCH_MEMCOST, TWOCATS_MULTIPLIES,
+                    TWOCATS_LANES, parallelism, TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE,
+                    TWOCATS_OVERWRITECOST, false)) {
+                fprintf(stderr, "Password hashing failed!\n");
+                exit(1);
+            }
+            for(uint32_t i = 0; i < 11; i++) {
+                uint8_t hash[keySize];
+                passwordSizes[i] = snprintf((char *)passwords[i], 12, "password%u", i);
+                memcpy(salts[i], "salt", 4);
+                if(!TwoCats_HashPasswordExtended(NULL, hashType, hash, passwords[i],
+                        passwordSizes[i], salts[i], 4, NULL, 0, BATCH_MEMCOST, BATCH_MEMCOST,
+                        TWOCATS_MULTIPLIES, TWOCATS_LANES, parallelism, TWOCATS_BLOCKSIZE,
+                        TWOCATS_SUBBLOCKSIZE, TWOCATS_OVERWRITECOST, false, false)) {
+                    fprintf(stderr, "Password hashing failed!\n");
+                    exit(1);
+                }
+                if(memcmp(hash, hashes[i], keySize)) {
+                    fprintf(stderr, "Password batch got wrong answer with %s!\n",
+                        TwoCats_GetImplementationName(impl));
+                    exit(1);
+                }
+            }
+        }
+    }
+    TwoCats_SetImplementation(defaultImpl);
+}
+
+// TwoCats_HashPasswordFull must hash with the profile's settings, and profiles must
+// survive being saved and loaded.
+void verifyProfile(TwoCats_HashType hashType) {
+    uint32_t keySize = TwoCats_GetHashTypeSize(hashType);
+    TwoCats_Parameters params = {hashType, 0, 1, 2, 0, 4096, 128, 0.0, 0.0};
+    TwoCats_Parameters loaded;
+    if(!TwoCats_SetProfileParameters(&params) || !TwoCats_SaveProfile("twocats-test.profile") ||
+            !TwoCats_LoadProfile("twocats-test.profile") ||
+            !TwoCats_GetProfileParameters(hashType, &loaded) ||
+            loaded.lanes != params.lanes || loaded.multiplies != params.multiplies ||
+            loaded.blockSize != params.blockSize || loaded.subBlockSize != params.subBlockSize) {
+        fprintf(stderr, "Tuning profile was not saved and loaded!\n");
+        exit(1);
+    }
+    uint8_t password[8];
+    memcpy(password, "password", 8);
+    uint8_t salt[4];
+    memcpy(salt, "salt", 4);
+    uint8_t hash1[keySize], hash2[keySize];
+    if(!TwoCats_HashPasswordFull(hashType, hash1, password, 8, salt, 4, TEST_MEMCOST, 1,
+            false)) {
+        fprintf(stderr, "Password hashing failed!\n");
+        exit(1);
+    }
+    memcpy(password, "password", 8);
+    memcpy(salt, "salt", 4);
+    if(!TwoCats_HashPasswordExtended(NULL, hashType, hash2, password, 8, salt, 4, NULL, 0,
+            TEST_MEMCOST, TEST_MEMCOST, params.multiplies, params.lanes, 1, params.blockSize,
+            params.subBlockSize, TWOCATS_OVERWRITECOST, false, false)) {
+        fprintf(stderr, "Password hashing failed!\n");
+        exit(1);
+    }
+    if(memcmp(hash1, hash2, keySize)) {
+        fprintf(stderr, "Password hashing did not use the tuning profile!\n");
+        exit(1);
+    }
+    // An empty profile puts the defaults back
+    FILE *file = fopen("twocats-test.profile", "w");
+    fprintf(file, "version %u\n", TWOCATS_PROFILE_VERSION);
+    fclose(file);
+    if(!TwoCats_LoadProfile("twocats-test.profile") ||
+            TwoCats_GetProfileParameters(hashType, &loaded)) {
+        fprintf(stderr, "Empty tuning profile was not loaded!\n");
+        exit(1);
+    }
+    remove("twocats-test.profile");
+}
+
+// Calibration must find parameters we can hash with, within the memory limit.
+void verifyCalibration(void) {
+    TwoCats_Parameters params;
+    if(!TwoCats_CalibrateParameters(TWOCATS_BLAKE2S, 16, 1 << TEST_MEMCOST, 2, &params)) {
+        fprintf(stderr, "Calibration failed!\n");
+        exit(1);
+    }
+    if(params.memCost > TEST_MEMCOST || params.parallelism < 1 || params.parallelism > 2 ||
+            params.runtime <= 0.0 || params.runtimeVariance < 0.0) {
+        fprintf(stderr, "Calibration found bad parameters!\n");
+        exit(1);
+    }
+    uint8_t hash[32];
+    if(!TwoCats_HashPasswordExtended(NULL, params.hashType, hash, NULL, 0, NULL, 0, NULL, 0,
+            params.memCost, params.memCost, params.multiplies, params.lanes,
+            params.parallelism, params.blockSize, params.subBlockSize, 0, false, false)) {
+        fprintf(stderr, "Password hashing with calibrated parameters failed!\n");
+        exit(1);
+    }
+}
+
+// Counts of each event type, and the bytes they report.  Slice events can come from
+// several threads at once.
+typedef struct {
+    uint64_t events[TWOCATS_EVENT_NONE];
+    uint64_t bytes[TWOCATS_EVENT_NONE];
+    uint64_t resistantSlices;
+} EventCounts;
+
+static void countEvent(const TwoCats_Event *event, void *userData) {
+    EventCounts *counts = (EventCounts *)userData;
+    __atomic_fetch_add(counts->events + event->type, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(counts->bytes + event->type, event->bytes, __ATOMIC_RELAXED);
+    if(event->type == TWOCATS_EVENT_SLICE_BEGIN && event->resistant) {
+        __atomic_fetch_add(&counts->resistantSlices, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Every level and slice must be reported once at the start and once at the end, and the
+// slices must add up to the level.
+void verifyEvents(void) {
+    EventCounts counts;
+    memset(&counts, 0, sizeof(counts));
+    TwoCats_SetEventCallback(countEvent, &counts);
+    uint8_t hash[32];
+    if(!TwoCats_HashPasswordExtended(NULL, TWOCATS_BLAKE2S, hash, NULL, 0, NULL, 0, NULL, 0,
+            TEST_MEMCOST, TEST_MEMCOST, TWOCATS_MULTIPLIES, TWOCATS_LANES, 2,
+            TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE, 0, false, false)) {
+        fprintf(stderr, "Password hashing failed!\n");
+        exit(1);
+    }
+    TwoCats_SetEventCallback(NULL, NULL);
+    if(counts.events[TWOCATS_EVENT_LEVEL_BEGIN] != 1 ||
+            counts.events[TWOCATS_EVENT_LEVEL_END] != 1 ||
+            counts.events[TWOCATS_EVENT_SLICE_BEGIN] != 2*TWOCATS_SLICES ||
+            counts.events[TWOCATS_EVENT_SLICE_END] != 2*TWOCATS_SLICES ||
+            counts.resistantSlices != TWOCATS_SLICES) {
+        fprintf(stderr, "Wrong number of hashing events!\n");
+        exit(1);
+    }
+    if(counts.bytes[TWOCATS_EVENT_LEVEL_BEGIN] != (uint64_t)1024 << TEST_MEMCOST ||
+            counts.bytes[TWOCATS_EVENT_SLICE_END] != (uint64_t)1024 << TEST_MEMCOST) {
+        fprintf(stderr, "Hashing events reported the wrong number of bytes!\n");
+        exit(1);
+    }
+}
+
+// The statistics must count one hash of one level, and start over when reset.
+void verifyStats(void) {
+    TwoCats_ResetStats();
+    uint8_t hash[32];
+    if(!TwoCats_HashPasswordExtended(NULL, TWOCATS_BLAKE2S, hash, NULL, 0, NULL, 0, NULL, 0,
+            TEST_MEMCOST, TEST_MEMCOST, TWOCATS_MULTIPLIES, TWOCATS_LANES, 2,
+            TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE, 0, false, false)) {
+        fprintf(stderr, "Password hashing failed!\n");
+        exit(1);
+    }
+    TwoCats_Stats stats;
+    TwoCats_GetStats(&stats);
+    uint64_t blocks = ((uint64_t)1024 << TEST_MEMCOST)/TWOCATS_BLOCKSIZE;
+    if(stats.hashes != 1 || stats.levels != 1 ||
+            stats.bytesHashed != (uint64_t)1024 << TEST_MEMCOST ||
+            stats.hashStateCalls != blocks - 2 || stats.resistantNanoseconds == 0 ||
+            stats.passwordNanoseconds == 0 || stats.levelHashNanoseconds != 0) {
+        fprintf(stderr, "Wrong hashing statistics!\n");
+        exit(1);
+    }
+    TwoCats_ResetStats();
+    TwoCats_GetStats(&stats);
+    if(stats.hashes != 0 || stats.bytesHashed != 0 || stats.passwordNanoseconds != 0) {
+        fprintf(stderr, "Hashing statistics were not reset!\n");
+        exit(1);
+    }
+}
+
+// Count how many spans with this name are in the trace file.
+static uint32_t countTraceSpans(char *trace, char *name) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+    uint32_t count = 0;
+    for(char *p = strstr(trace, pattern); p != NULL; p = strstr(p + 1, pattern)) {
+        count++;
+    }
+    return count;
+}
+
+// The trace must have every span of one hash with two threads.
+void verifyTrace(void) {
+    if(!TwoCats_StartTrace(1024)) {
+        fprintf(stderr, "Unable to start tracing!\n");
+        exit(1);
+    }
+    uint8_t hash[32];
+    if(!TwoCats_HashPasswordExtended(NULL, TWOCATS_BLAKE2S, hash, NULL, 0, NULL, 0, NULL, 0,
+            TEST_MEMCOST, TEST_MEMCOST, TWOCATS_MULTIPLIES, TWOCATS_LANES, 2,
+            TWOCATS_BLOCKSIZE, TWOCATS_SUBBLOCKSIZE, 0, false, false)) {
+        fprintf(stderr, "Password hashing failed!\n");
+        exit(1);
+    }
+    TwoCats_StopTrace();
+    if(!TwoCats_WriteTrace("twocats-test.trace")) {
+        exit(1);
+    }
+    FILE *file = fopen("twocats-test.trace", "r");
+    char trace[1 << 16];
+    uint32_t length = fread(trace, 1, sizeof(trace) - 1, file);
+    trace[length] = '\0';
+    fclose(file);
+    remove("twocats-test.trace");
+    if(countTraceSpans(trace, "allocateMemory") != 1 ||
+            countTraceSpans(trace, "hashMemory") != 1 ||
+            countTraceSpans(trace, "hashWithoutPassword") != TWOCATS_SLICES ||
+            countTraceSpans(trace, "hashWithPassword") != TWOCATS_SLICES ||
+            countTraceSpans(trace, "finalHash") != 1) {
+        fprintf(stderr, "Wrong spans in trace!\n");
+        exit(1);
+    }
+}
 
 /*******************************************************************/
 
@@ -165,7 +528,16 @@ int main()
         printf("****************************************** Testing hash type %s\n", TwoCats_GetHashTypeName(hashType));
         verifyPasswordUpdate(hashType);
         verifyClientServer(hashType);
+        verifyImplementations(hashType);
+        verifyStoreModes(hashType);
+        verifyContext(hashType);
+        verifyBatch(hashType);
+        verifyProfile(hashType);
         PHC_test(hashType);
     }
+    verifyCalibration();
+    verifyEvents();
+    verifyStats();
+    verifyTrace();
     return 0;
 }
@@ -0,0 +1,189 @@
+/*
+   TwoCats tracing, which records a timeline of hashing in per-thread ring buffers, and
+   writes it in the Chrome trace-event format.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// Needed for syscall with -std=c99
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "twocats-internal.h"
+
+// How many spans each thread keeps when tracing is started by $TWOCATS_TRACE.
+#define TWOCATS_TRACE_ENVEVENTS 65536
+
+typedef struct {
+    uint64_t start, end; // Nanoseconds
+    uint8_t type;
+    uint8_t memCost;
+    uint8_t slice;
+    uint8_t thread;
+} TwoCats_TraceSpan;
+
+// Each thread records into its own ring buffer, so recording takes no locks.  When the
+// buffer is full, the oldest spans are overwritten.
+struct TwoCatsTraceBufferStruct {
+    TwoCats_TraceSpan *spans;
+    uint32_t capacity;
+    uint64_t numSpans; // Spans ever recorded, written only by this thread
+    long tid;
+    struct TwoCatsTraceBufferStruct *next;
+};
+
+bool TwoCats_TraceOn = false;
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct TwoCatsTraceBufferStruct *traceBuffers = NULL;
+static uint32_t traceCapacity = 0;
+// Starting a trace makes every thread get a new buffer.
+static uint32_t traceGeneration = 0;
+static __thread struct TwoCatsTraceBufferStruct *threadBuffer = NULL;
+static __thread uint32_t threadGeneration = 0;
+static char *envTracePath = NULL;
+
+static char *spanNames[TWOCATS_TRACE_NONE] = {"allocateMemory", "hashMemory",
+    "hashWithoutPassword", "hashWithPassword", "finalHash"};
+
+// Write the trace named by the environment when the process exits.
+static void writeEnvironmentTrace(void) {
+    TwoCats_StopTrace();
+    TwoCats_WriteTrace(envTracePath);
+}
+
+// Start tracing when the library loads if $TWOCATS_TRACE names a file to write it to.
+static void __attribute__((constructor)) startEnvironmentTrace(void) {
+    char *path = getenv(TWOCATS_TRACE_ENV);
+    if(path != NULL && *path != '\0' && TwoCats_StartTrace(TWOCATS_TRACE_ENVEVENTS)) {
+        envTracePath = path;
+        atexit(writeEnvironmentTrace);
+    }
+}
+
+// Free every buffer.  Call with traceMutex held.
+static void freeTraceBuffers(void) {
+    while(traceBuffers != NULL) {
+        struct TwoCatsTraceBufferStruct *buffer = traceBuffers;
+        traceBuffers = buffer->next;
+        free(buffer->spans);
+        free(buffer);
+    }
+}
+
+// Throw away any earlier trace, and start recording up to spansPerThread of the latest
+// spans on each thread.  Return false if spansPerThread is 0.
+bool TwoCats_StartTrace(uint32_t spansPerThread) {
+    if(spansPerThread == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&traceMutex);
+    freeTraceBuffers();
+    traceCapacity = spansPerThread;
+    traceGeneration++;
+    __atomic_store_n(&TwoCats_TraceOn, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&traceMutex);
+    return true;
+}
+
+// Stop recording.  The trace is kept until it is written or tracing is started again.
+void TwoCats_StopTrace(void) {
+    __atomic_store_n(&TwoCats_TraceOn, false, __ATOMIC_RELEASE);
+}
+
+// Return this thread's buffer, making one if this thread has none for this trace.
+static struct TwoCatsTraceBufferStruct *getThreadBuffer(void) {
+    if(threadBuffer != NULL && threadGeneration == traceGeneration) {
+        return threadBuffer;
+    }
+    struct TwoCatsTraceBufferStruct *buffer = calloc(1,
+        sizeof(struct TwoCatsTraceBufferStruct));
+    if(buffer == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&traceMutex);
+    buffer->capacity = traceCapacity;
+    buffer->spans = malloc((uint64_t)traceCapacity*sizeof(TwoCats_TraceSpan));
+    if(buffer->spans == NULL) {
+        pthread_mutex_unlock(&traceMutex);
+        free(buffer);
+        return NULL;
+    }
+    buffer->tid = syscall(SYS_gettid);
+    buffer->next = traceBuffers;
+    traceBuffers = buffer;
+    threadGeneration = traceGeneration;
+    pthread_mutex_unlock(&traceMutex);
+    threadBuffer = buffer;
+    return buffer;
+}
+
+// Record a span in this thread's ring buffer.  If we are out of memory, it is dropped.
+void TwoCats_RecordTrace(TwoCats_TraceType type, uint64_t start, uint64_t end,
+        uint8_t memCost, uint8_t slice, uint8_t thread) {
+    struct TwoCatsTraceBufferStruct *buffer = getThreadBuffer();
+    if(buffer == NULL) {
+        return;
+    }
+    TwoCats_TraceSpan *span = buffer->spans + buffer->numSpans % buffer->capacity;
+    span->start = start;
+    span->end = end;
+    span->type = type;
+    span->memCost = memCost;
+    span->slice = slice;
+    span->thread = thread;
+    __atomic_store_n(&buffer->numSpans, buffer->numSpans + 1, __ATOMIC_RELEASE);
+}
+
+// Write the trace in the Chrome trace-event format, which chrome://tracing and Perfetto
+// can show.  Each span is a complete ("X") event on the thread that ran it.  Stop tracing
+// first, or spans being overwritten while we write may be garbled.  Return false if the
+// file can't be written.
+bool TwoCats_WriteTrace(const char *path) {
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        fprintf(stderr, "Unable to write trace %s\n", path);
+        return false;
+    }
+    long pid = getpid();
+    uint64_t dropped = 0;
+    bool first = true;
+    fprintf(file, "{\"traceEvents\": [");
+    pthread_mutex_lock(&traceMutex);
+    for(struct TwoCatsTraceBufferStruct *buffer = traceBuffers; buffer != NULL;
+            buffer = buffer->next) {
+        uint64_t numSpans = __atomic_load_n(&buffer->numSpans, __ATOMIC_ACQUIRE);
+        uint64_t firstSpan = 0;
+        if(numSpans > buffer->capacity) {
+            firstSpan = numSpans - buffer->capacity;
+            dropped += firstSpan;
+        }
+        for(uint64_t i = firstSpan; i < numSpans; i++) {
+            TwoCats_TraceSpan *span = buffer->spans + i % buffer->capacity;
+            fprintf(file, "%s\n  {\"name\": \"%s\", \"cat\": \"twocats\", \"ph\": \"X\", "
+                "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %ld, \"tid\": %ld, "
+                "\"args\": {\"memCost\": %u", first? "" : ",", spanNames[span->type],
+                span->start/1000.0, (span->end - span->start)/1000.0, pid, buffer->tid,
+                span->memCost);
+            if(span->type == TWOCATS_TRACE_RESISTANT || span->type == TWOCATS_TRACE_PASSWORD) {
+                fprintf(file, ", \"slice\": %u, \"thread\": %u", span->slice, span->thread);
+            }
+            fprintf(file, "}}");
+            first = false;
+        }
+    }
+    pthread_mutex_unlock(&traceMutex);
+    fprintf(file, "\n], \"displayTimeUnit\": \"ns\", \"otherData\": {\"droppedSpans\": %llu}}\n",
+        (unsigned long long)dropped);
+    return fclose(file) == 0;
+}
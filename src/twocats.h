@@ -63,6 +63,64 @@ char *TwoCats_GetHashTypeName(TwoCats_HashType hashType);
 TwoCats_HashType TwoCats_FindHashType(char *name);
 uint8_t TwoCats_GetHashTypeSize(TwoCats_HashType hashType);
 
+// The memory hashing and Blake2 code is compiled for each of these instruction sets.  When
+// the library loads, it picks the fastest one this CPU supports.  Every implementation
+// computes the same hashes.
+typedef enum {
+    TWOCATS_IMPL_GENERIC,
+    TWOCATS_IMPL_SSE2,
+    TWOCATS_IMPL_SSSE3,
+    TWOCATS_IMPL_SSE41,
+    TWOCATS_IMPL_AVX2,
+    TWOCATS_IMPL_AVX512,
+    TWOCATS_IMPL_NONE
+} TwoCats_Implementation;
+
+char *TwoCats_GetImplementationName(TwoCats_Implementation impl);
+TwoCats_Implementation TwoCats_FindImplementation(char *name);
+bool TwoCats_ImplementationSupported(TwoCats_Implementation impl);
+// Return the implementation in use.
+TwoCats_Implementation TwoCats_GetImplementation(void);
+// Force an implementation, for example to benchmark them.  Return false if this CPU does
+// not support it.
+bool TwoCats_SetImplementation(TwoCats_Implementation impl);
+
+// A block of memory is not read again until long after it is written, so when memory
+// is larger than the last level cache, writing it through the cache just evicts data we
+// need.  In streaming mode, the memory hashing kernels write blocks with stores that
+// bypass the cache, and keep a copy of the last block, which is read right away, in a
+// small per-thread buffer.  The store mode only changes speed, not the hashes.
+typedef enum {
+    TWOCATS_STORES_AUTO, // Stream when memory is larger than the last level cache
+    TWOCATS_STORES_NORMAL,
+    TWOCATS_STORES_STREAMING,
+    TWOCATS_STORES_NONE
+} TwoCats_StoreMode;
+
+char *TwoCats_GetStoreModeName(TwoCats_StoreMode storeMode);
+TwoCats_StoreMode TwoCats_FindStoreMode(char *name);
+TwoCats_StoreMode TwoCats_GetStoreMode(void);
+// Set the store mode for hashes started after this.  Return false if storeMode is invalid.
+bool TwoCats_SetStoreMode(TwoCats_StoreMode storeMode);
+// Return the size of the last level cache in bytes, or 0 if we can't tell.
+uint64_t TwoCats_GetLastLevelCacheSize(void);
+
+// The sizes of CPU 0's caches in bytes, found when the library loads, or 0 if unknown.
+typedef struct {
+    uint64_t l1DataSize;
+    uint64_t l2Size;
+    uint64_t lastLevelSize;
+    uint32_t lineSize;
+    uint32_t cpusPerL2; // How many CPUs share each L2 cache
+} TwoCats_CacheInfo;
+
+void TwoCats_GetCacheInfo(TwoCats_CacheInfo *info);
+// Pick blockSize and subBlockSize for this machine's caches: the largest blockSize for
+// which three blocks per thread sharing an L2 cache fit in half of it, and a subBlockSize
+// of one cache line.  Like the other parameters, these are part of the hash.
+void TwoCats_FindBlockSizes(uint8_t lanes, uint8_t parallelism, uint32_t *blockSize,
+    uint32_t *subBlockSize);
+
 // The default password hashing interface.  On success, a hashSize byte
 // password hash is written, the password and salt are set to 0's, and true is
 // returned.  Otherwise false is returned, and hash, password, and salt are
@@ -75,7 +133,8 @@ bool TwoCats_HashPassword(uint8_t *hash, uint8_t *password, uint32_t passwordSiz
 // The full password hashing interface.  On success, true is returned,
 // otherwise false.  Memory hashed = 2^memCost KiB.
 // Number of threads used = parallelism.  The password and salt
-// are set to 0's early during the hashing.
+// are set to 0's early during the hashing.  The other parameters come from the
+// tuning profile, if there is one (see TwoCats_LoadProfile below).
 //
 // The final parameter, sideChannelResistant should probably be false for most
 // use cases, even in cloud based password managers.  Some use cases, such as
@@ -176,12 +235,243 @@ bool TwoCats_ClientHashPassword(void *memory, TwoCats_HashType hashType, uint8_t
 // Server portion of work for server-relief mode.
 bool TwoCats_ServerHashPassword(TwoCats_HashType hashType, uint8_t *hash);
 
+// Hash numPasswords passwords and salts with the same parameters, writing hashes[i] for
+// passwords[i] and salts[i].  The hashes are the same as calling
+// TwoCats_HashPasswordExtended on each with no data, but with small memCost, it is
+// much faster: with Blake2s and parallelism 1, the optimized version hashes 8 at a time
+// in lock-step, and with AVX2 does their Blake2s compressions in parallel.  This is only
+// done when 8 hashes' memory, 8*2^stopMemCost KiB, fits in the last level cache, and
+// that is how much memory a call allocates.  Otherwise, they are hashed one at a time,
+// allocating 2^stopMemCost KiB for each.  All the passwords and salts are set to 0's.
+bool TwoCats_HashPasswordBatch(TwoCats_HashType hashType, uint32_t numPasswords,
+    uint8_t **hashes, uint8_t **passwords, uint32_t *passwordSizes, uint8_t **salts,
+    uint32_t *saltSizes, uint8_t startMemCost, uint8_t stopMemCost, uint8_t multiplies,
+    uint8_t lanes, uint8_t parallelism, uint32_t blockSize, uint32_t subBlockSize,
+    uint8_t overwriteCost, bool sideChannelResistant);
+
+// Pin memory hashing threads to CPUs, so that thread p always runs on
+// cpus[p % numCpus], and memory is first touched by the thread that hashes it.
+// On NUMA machines, this puts each thread's memory on its own node.  Pass
+// numCpus = 0 to let threads run anywhere again.  This affects all hashes in
+// the process.  Return false if the calling thread is not allowed to run on
+// one of the CPUs.
+bool TwoCats_SetThreadAffinity(const uint32_t *cpus, uint32_t numCpus);
+
+/*
+   Memory hashing reports events to a callback, so tools can measure each level
+   of garlic and each slice of it, for example with hardware performance
+   counters (see tools/twocats-bench.c).  Level events are reported by the
+   thread that called TwoCats, before and after hashing memory for a level.
+   Slice events are reported by the thread hashing thread p's memory, before
+   and after each of its slices, so in the optimized version the callback is
+   called from several threads at once, and must be thread-safe.  The
+   reference version hashes every thread's memory on the calling thread.
+   TwoCats_HashPasswordBatch reports no events.
+*/
+typedef enum {
+    TWOCATS_EVENT_LEVEL_BEGIN,
+    TWOCATS_EVENT_LEVEL_END,
+    TWOCATS_EVENT_SLICE_BEGIN,
+    TWOCATS_EVENT_SLICE_END,
+    TWOCATS_EVENT_NONE
+} TwoCats_EventType;
+
+typedef struct {
+    TwoCats_EventType type;
+    uint8_t memCost; // The level of garlic
+    uint8_t multiplies;
+    uint8_t lanes;
+    uint8_t parallelism;
+    uint8_t thread; // For slice events, whose memory is being hashed
+    uint8_t slice; // For slice events, 0 to 3
+    bool resistant; // Addresses do not depend on the password, in every slice of a level
+    uint64_t bytes; // Memory written by the level, or by this thread in this slice
+} TwoCats_Event;
+
+typedef void (*TwoCats_EventCallback)(const TwoCats_Event *event, void *userData);
+
+char *TwoCats_GetEventTypeName(TwoCats_EventType type);
+// Set the callback for hashes started after this, or NULL for none.  Don't call this
+// while another thread is hashing.
+void TwoCats_SetEventCallback(TwoCats_EventCallback callback, void *userData);
+// Return the callback, and write its user data to userData if it is not NULL.
+TwoCats_EventCallback TwoCats_GetEventCallback(void **userData);
+
+// Runtime statistics, added up over every thread since the library loaded or
+// TwoCats_ResetStats was called.  Times are in nanoseconds.  Times for hashing slices
+// and waiting are added up over the hashing threads, so with parallelism > 1 they can be
+// more than the wall-clock time.  Slice times include waiting for other threads' blocks.
+// TwoCats_HashPasswordBatch is not counted.
+typedef struct {
+    uint64_t hashes; // Passes of memory hashing, including each client-side hash
+    uint64_t levels; // Levels of garlic that hashed memory
+    uint64_t bytesHashed; // Memory written by memory hashing
+    uint64_t hashStateCalls; // One H->HashState per block hashed
+    uint64_t allocationNanoseconds; // Allocating memory in TwoCats
+    uint64_t expansionNanoseconds; // Expanding the hash into each thread's state
+    uint64_t resistantNanoseconds; // Slices with password-independent addresses
+    uint64_t passwordNanoseconds; // Slices with password-dependent addresses
+    uint64_t waitNanoseconds; // Waiting for other threads' blocks, and for threads to finish
+    uint64_t finalHashNanoseconds; // Adding thread states into the hash, and hashing it
+    uint64_t levelHashNanoseconds; // Hashing between levels of garlic
+} TwoCats_Stats;
+
+// Read the statistics.  This is safe to call while other threads are hashing.
+void TwoCats_GetStats(TwoCats_Stats *stats);
+// Start the statistics from 0 again.
+void TwoCats_ResetStats(void);
+
+/*
+   Tracing records a timeline of hashing, to find threads that fall behind: memory
+   allocation, hashMemory for each level, each thread's slices, and the final hash of
+   each level.  Each thread records into its own ring buffer, keeping its latest spans,
+   and TwoCats_WriteTrace writes them in the Chrome trace-event JSON format, which
+   chrome://tracing and https://ui.perfetto.dev show.  Tracing is off unless started,
+   and then costs a load and a branch per span.  If $TWOCATS_TRACE is set when the
+   library loads, tracing starts, and the trace is written to that file at exit.
+   Don't start tracing while another thread is hashing.
+*/
+#define TWOCATS_TRACE_ENV "TWOCATS_TRACE"
+
+// Throw away any earlier trace, and start recording up to spansPerThread of the latest
+// spans on each thread.  Return false if spansPerThread is 0.
+bool TwoCats_StartTrace(uint32_t spansPerThread);
+// Stop recording.  The trace is kept until it is written or tracing is started again.
+void TwoCats_StopTrace(void);
+// Write the trace.  Stop tracing first.  Return false if the file can't be written.
+bool TwoCats_WriteTrace(const char *path);
+
+/*
+   TwoCats reads memory at random block addresses, so with normal 4 KiB pages
+   it misses the TLB on most blocks once memCost is 18 or more.  Huge pages fix
+   this.  The page modes are ordered from smallest to largest pages:
+
+   TWOCATS_PAGES_DEFAULT      -- whatever malloc gives us
+   TWOCATS_PAGES_TRANSPARENT  -- transparent huge pages, asked for with madvise
+   TWOCATS_PAGES_HUGE2M       -- 2 MiB pages reserved in /proc/sys/vm/nr_hugepages
+   TWOCATS_PAGES_HUGE1G       -- 1 GiB pages reserved with hugepagesz=1G
+
+   Asking for a page mode gets the largest pages up to that size that the
+   system can give, falling back to smaller ones, so it is always safe to ask
+   for TWOCATS_PAGES_HUGE1G.  Regions smaller than a huge page use smaller
+   pages rather than being rounded up.  The page mode obtained is only
+   TWOCATS_PAGES_TRANSPARENT if the kernel actually backed the memory with a
+   transparent huge page, not just if madvise succeeded.
+*/
+typedef enum {
+    TWOCATS_PAGES_DEFAULT,
+    TWOCATS_PAGES_TRANSPARENT,
+    TWOCATS_PAGES_HUGE2M,
+    TWOCATS_PAGES_HUGE1G,
+    TWOCATS_PAGES_NONE
+} TwoCats_PageMode;
+
+char *TwoCats_GetPageModeName(TwoCats_PageMode pageMode);
+TwoCats_PageMode TwoCats_FindPageMode(char *name);
+
+// Allocate 64-byte aligned memory for hashing 2^memCost KiB, suitable for passing to
+// TwoCats_HashPasswordExtended.  The page mode obtained is written to obtainedPageMode
+// if it is not NULL.  Return NULL if out of memory.
+void *TwoCats_AllocateMemory(uint8_t memCost, TwoCats_PageMode pageMode,
+    TwoCats_PageMode *obtainedPageMode);
+
+// Free memory from TwoCats_AllocateMemory.  memCost and pageMode must be the ones
+// used and obtained when allocating it.
+void TwoCats_FreeMemory(void *memory, uint8_t memCost, TwoCats_PageMode pageMode);
+
+/*
+   A hashing context keeps the memory TwoCats hashes allocated between calls.
+   Without one, every hash allocates 2^memCost KiB and pays a page fault on
+   each page of it the first time it is written, which for 1 GiB can cost more
+   than the hashing.  A context allocates 64-byte aligned buffers for each
+   memCost it is asked for, with TwoCats_AllocateMemory and the context's
+   pageMode, writes to every page once up front using parallelism threads,
+   and reuses the buffers for later hashes, so a server hashing many passwords
+   does no allocation and takes no page faults.
+
+   A context can be shared by any number of threads.  Each concurrent hash
+   needs its own buffer, so call TwoCats_ReserveContextMemory with the number
+   of hashes you expect to run at once.  If more are needed, they are
+   allocated on demand and kept.  Buffers are not cleared between hashes, so
+   they hold password-derived data until the context is freed.
+*/
+typedef struct TwoCatsHashContextStruct TwoCats_Context;
+
+// Create a context.  Return NULL if out of memory.
+TwoCats_Context *TwoCats_CreateContext(uint8_t parallelism, TwoCats_PageMode pageMode);
+
+// Make sure at least numBuffers buffers of 2^memCost KiB are allocated and
+// pre-faulted.  If obtainedPageMode is not NULL, the smallest page mode of any
+// of these buffers is written to it.  Return false if out of memory.
+bool TwoCats_ReserveContextMemory(TwoCats_Context *context, uint8_t memCost,
+    uint32_t numBuffers, TwoCats_PageMode *obtainedPageMode);
+
+// Free the context and all of its memory.  No hashes may be running in it.
+void TwoCats_FreeContext(TwoCats_Context *context);
+
+// The same as TwoCats_HashPasswordExtended, but hashing in a buffer from the context.
+bool TwoCats_HashPasswordContext(TwoCats_Context *context, TwoCats_HashType hashType,
+    uint8_t *hash, uint8_t *password, uint32_t passwordSize, uint8_t *salt,
+    uint32_t saltSize, uint8_t *data, uint32_t dataSize, uint8_t startMemCost,
+    uint8_t stopMemCost, uint8_t multiplies, uint8_t lanes, uint8_t parallelism,
+    uint32_t blockSize, uint32_t subBlockSize, uint8_t overwriteCost,
+    bool clearData, bool sideChannelResistant);
+
 // Find parameter settings on this machine for a given desired runtime and
 // maximum memory usage.  maxMem is in KiB.  Runtime with smaller than
 // milliseconds within about 50%. Memory will be <= maxMem.
 void TwoCats_FindCostParameters(TwoCats_HashType hashType, uint32_t milliSeconds,
     uint32_t maxMem, uint8_t *memCost, uint8_t *multplies, uint8_t *lanes);
 
+// A full set of parameters for TwoCats_HashPasswordExtended, and how long hashing with
+// them took when calibrated: the median and variance of the wall-clock runtime.
+typedef struct {
+    TwoCats_HashType hashType;
+    uint8_t memCost;
+    uint8_t multiplies;
+    uint8_t lanes;
+    uint8_t parallelism;
+    uint32_t blockSize;
+    uint32_t subBlockSize;
+    double runtime; // Milliseconds
+    double runtimeVariance; // Milliseconds squared
+} TwoCats_Parameters;
+
+// Search memCost, multiplies, parallelism, blockSize, and subBlockSize for the
+// parameters that hash the most memory on this machine in at most milliseconds of
+// wall-clock time.  Memory will be <= maxMem KiB, and parallelism <= maxParallelism, or
+// the number of online CPUs if maxParallelism is 0.  Each setting is timed several
+// times, and compared by the median.  Return false if memory allocation fails.
+bool TwoCats_CalibrateParameters(TwoCats_HashType hashType, uint32_t milliseconds,
+    uint32_t maxMem, uint8_t maxParallelism, TwoCats_Parameters *params);
+
+// A tuning profile sets the lanes, multiplies, blockSize, and subBlockSize that
+// TwoCats_HashPasswordFull and TwoCats_HashPassword use for each hash type, so they can
+// be tuned to this machine's caches and SIMD width by tools/twocats-calibrate.  Hash
+// types not in the profile use the defaults.  When the library loads, it reads the
+// profile file named by $TWOCATS_PROFILE, if set.  If that fails, those functions fail
+// rather than hash with the defaults.
+//
+// The profile's settings become part of the hash parameters, just like memCost: a
+// password hashed with one profile only verifies with the same profile.  Keep the
+// profile with the password database, and don't recalibrate once hashes are stored.
+//
+// These functions may be called while other threads hash.  Each hash uses either the old
+// or the new settings for its hash type, never a mix of them.
+#define TWOCATS_PROFILE_VERSION 1
+#define TWOCATS_PROFILE_ENV "TWOCATS_PROFILE"
+
+// Read a profile, replacing the current one.  Return false if the file can't be read,
+// is another version, or has invalid settings.
+bool TwoCats_LoadProfile(const char *path);
+// Write the current profile.  Return false if the file can't be written.
+bool TwoCats_SaveProfile(const char *path);
+// Set the profile's settings for params->hashType, ignoring memCost and parallelism.
+// Return false if they are invalid.
+bool TwoCats_SetProfileParameters(const TwoCats_Parameters *params);
+// Find the profile's settings for a hash type.  Return false if it has none.
+bool TwoCats_GetProfileParameters(TwoCats_HashType hashType, TwoCats_Parameters *params);
+
 // This is the prototype required for the password hashing competition.  It uses Blake2s.
 // Do not use this, as it leaves the password and salt lying around in memory too long.
 int PHS(void *out, size_t outlen, const void *in, size_t inlen, const void *salt, size_t saltlen,
@@ -38,12 +38,23 @@ static void usage(char *format, ...) {
         "    -o overwriteCost -- Overwrite memCost-overwriteCost memory (0 disables)\n"
         "    -i iterations    -- Call the hash function this number of times\n"
         "    -r               -- Enable side-channel-resistant mode\n"
+        "    -I implementation -- Force a SIMD implementation rather than the fastest one\n"
+        "    -H pageMode      -- Hash in memory allocated once with default, transparent,\n"
+        "                        2m, or 1g pages (twocats-extended only)\n"
+        "    -C cpus          -- Pin thread p to the p'th CPU in a list like 0-3,8\n"
+        "    -S storeMode     -- auto (default), normal, or streaming stores to memory\n"
         "Hash types are");
     
     for(uint32_t i = 0; i < TWOCATS_NONE; i++) {
         char *name = TwoCats_GetHashTypeName(i);
         printf(" %s", name);
     }
+    printf("\nImplementations are");
+    for(uint32_t i = 0; i < TWOCATS_IMPL_NONE; i++) {
+        if(TwoCats_ImplementationSupported(i)) {
+            printf(" %s", TwoCats_GetImplementationName(i));
+        }
+    }
     printf("\n");
     exit(1);
 }
@@ -82,6 +93,40 @@ static bool readHexByte(uint8_t *dest, char *value) {
     return true;
 }
 
+// Read a CPU list like 0-3,8,10-11.  Return the number of CPUs.
+static uint32_t readCpuList(char *p, uint32_t *cpus, uint32_t maxCpus) {
+    uint32_t numCpus = 0;
+    while(*p != '\0') {
+        char *endPtr;
+        uint32_t first = strtoul(p, &endPtr, 10);
+        uint32_t last = first;
+        if(endPtr == p) {
+            usage("Invalid CPU list\n");
+        }
+        p = endPtr;
+        if(*p == '-') {
+            p++;
+            last = strtoul(p, &endPtr, 10);
+            if(endPtr == p || last < first) {
+                usage("Invalid CPU list\n");
+            }
+            p = endPtr;
+        }
+        for(uint32_t cpu = first; cpu <= last; cpu++) {
+            if(numCpus == maxCpus) {
+                usage("Too many CPUs in list\n");
+            }
+            cpus[numCpus++] = cpu;
+        }
+        if(*p == ',') {
+            p++;
+        } else if(*p != '\0') {
+            usage("Invalid CPU list\n");
+        }
+    }
+    return numCpus;
+}
+
 static uint8_t *readHexSalt(char *p, uint32_t *saltLength) {
     uint32_t length = strlen(p);
     if(length & 1) {
@@ -118,9 +163,10 @@ int main(int argc, char **argv) {
     char *algorithm = "twocats-extended";
     bool sideChannelResistant = false;
     uint32_t iterations = 1;
+    TwoCats_PageMode pageMode = TWOCATS_PAGES_NONE;
 
     char c;
-    while((c = getopt(argc, argv, "a:i:p:rs:m:M:o:l:P:b:B:")) != -1) {
+    while((c = getopt(argc, argv, "a:C:i:I:H:p:rs:S:m:M:o:l:P:b:B:")) != -1) {
         switch (c) {
         case 'a':
             algorithm = optarg;
@@ -161,6 +207,32 @@ int main(int argc, char **argv) {
         case 'i':
             iterations = readuint32_t(c, optarg);
             break;
+        case 'C': {
+            uint32_t cpus[1024];
+            uint32_t numCpus = readCpuList(optarg, cpus, 1024);
+            if(!TwoCats_SetThreadAffinity(cpus, numCpus)) {
+                usage("Unable to set thread affinity\n");
+            }
+            break;
+        }
+        case 'H':
+            pageMode = TwoCats_FindPageMode(optarg);
+            if(pageMode == TWOCATS_PAGES_NONE) {
+                usage("Unsupported page mode: %s\n", optarg);
+            }
+            break;
+        case 'S':
+            if(!TwoCats_SetStoreMode(TwoCats_FindStoreMode(optarg))) {
+                usage("Unsupported store mode: %s\n", optarg);
+            }
+            break;
+        case 'I': {
+            TwoCats_Implementation impl = TwoCats_FindImplementation(optarg);
+            if(impl == TWOCATS_IMPL_NONE || !TwoCats_SetImplementation(impl)) {
+                usage("Unsupported implementation: %s\n", optarg);
+            }
+            break;
+        }
         default:
             usage("Invalid argument");
         }
@@ -180,11 +252,20 @@ int main(int argc, char **argv) {
         hashName, memCost, multiplies, lanes, parallelism);
     printf("algorithm:%s password:%s salt:%s blockSize:%u subBlockSize:%u\n",
         algorithm, password, salt, blockSize, subBlockSize);
+    void *memory = NULL;
+    if(pageMode != TWOCATS_PAGES_NONE) {
+        memory = TwoCats_AllocateMemory(memCost, pageMode, &pageMode);
+        if(memory == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            return 1;
+        }
+        printf("pages:%s\n", TwoCats_GetPageModeName(pageMode));
+    }
     uint8_t derivedKeySize = TwoCats_GetHashTypeSize(hashType);
     uint8_t derivedKey[derivedKeySize];
     for(uint32_t i = 0; i < iterations; i++) {
         if(!strcmp(algorithm, "twocats-extended")) {
-            if(!TwoCats_HashPasswordExtended(NULL, hashType, derivedKey, password, passwordSize,
+            if(!TwoCats_HashPasswordExtended(memory, hashType, derivedKey, password, passwordSize,
                     salt, saltSize, NULL, 0, memCost, memCost, multiplies, lanes, parallelism,
                     blockSize, subBlockSize, overwriteCost, false, sideChannelResistant)) {
                 fprintf(stderr, "Key stretching failed.\n");
@@ -211,5 +292,8 @@ int main(int argc, char **argv) {
         }
     }
     TwoCats_PrintHex("", derivedKey, derivedKeySize);
+    if(memory != NULL) {
+        TwoCats_FreeMemory(memory, memCost, pageMode);
+    }
     return 0;
 }
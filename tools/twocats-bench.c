@@ -0,0 +1,877 @@
+/*
+   TwoCats benchmark, which reports throughput and latency over a sweep of parameters.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "twocats.h"
+
+// The Makefile builds this once against each library, and says which.
+#ifndef BENCH_LIBRARY
+#define BENCH_LIBRARY "opt"
+#endif
+
+#define MAX_VALUES 32
+#define MAX_SAMPLES 10000
+
+// A comma separated list of values to sweep, like 14,16,18.
+typedef struct {
+    uint32_t values[MAX_VALUES];
+    uint32_t numValues;
+} ValueList;
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON
+} Format;
+
+static void usage(char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, (char *)format, ap);
+    va_end(ap);
+    fprintf(stderr, "\nUsage: twocats-bench-" BENCH_LIBRARY " [OPTIONS] [hashType...]\n"
+        "Each of -m, -M, -l, -P, -b, and -B take a comma separated list of values, and\n"
+        "every combination is run, for each hash type listed (default blake2s).\n"
+        "    -m memCosts      -- Memory to hash = 2^memCost KiB, default 18\n"
+        "    -M multiplies    -- Multiplies per 32 bytes of hashing, default %u\n"
+        "    -l lanes         -- Parallel data lanes, default %u\n"
+        "    -P parallelism   -- Threads, default %u\n"
+        "    -b blockSizes    -- Block size, default %u\n"
+        "    -B subBlockSizes -- Sub-block size, default %u\n"
+        "    -n samples       -- Hashes timed for each combination, default 10\n"
+        "    -w warmups       -- Hashes run first and not timed, default 1\n"
+        "    -r               -- Enable side-channel-resistant mode\n"
+        "    -I implementation -- Force a SIMD implementation rather than the fastest one\n"
+        "    -H pageMode      -- default, transparent, 2m, or 1g pages\n"
+        "    -f format        -- text (default), csv, or json\n"
+        "    -e               -- Count cycles, instructions, LLC and dTLB misses, page faults,\n"
+        "                        and memory controller traffic for each level and slice\n",
+        TWOCATS_MULTIPLIES, TWOCATS_LANES, TWOCATS_PARALLELISM, TWOCATS_BLOCKSIZE,
+        TWOCATS_SUBBLOCKSIZE);
+    exit(1);
+}
+
+static uint32_t readuint32_t(char flag, char *arg) {
+    char *endPtr;
+    char *p = arg;
+    uint32_t value = strtol(p, &endPtr, 0);
+    if(*p == '\0' || *endPtr != '\0') {
+        usage("Invalid integer for parameter -%c", flag);
+    }
+    return value;
+}
+
+// Read a comma separated list of integers.
+static void readValueList(char flag, char *arg, ValueList *list) {
+    list->numValues = 0;
+    char *p = arg;
+    while(true) {
+        char *endPtr;
+        uint32_t value = strtoul(p, &endPtr, 0);
+        if(endPtr == p || (*endPtr != ',' && *endPtr != '\0')) {
+            usage("Invalid list of integers for parameter -%c", flag);
+        }
+        if(list->numValues == MAX_VALUES) {
+            usage("Too many values for parameter -%c", flag);
+        }
+        list->values[list->numValues++] = value;
+        if(*endPtr == '\0') {
+            return;
+        }
+        p = endPtr + 1;
+    }
+}
+
+static void setValueList(ValueList *list, uint32_t value) {
+    list->values[0] = value;
+    list->numValues = 1;
+}
+
+// Return the wall-clock time in milliseconds.
+static double getMilliseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000.0 + t.tv_nsec/1000000.0;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y? -1 : x > y;
+}
+
+// Return the p'th percentile of sorted times, by nearest rank.
+static double percentile(double *times, uint32_t numTimes, double p) {
+    uint32_t rank = (uint32_t)(p*numTimes + 0.999999);
+    return times[rank == 0? 0 : rank - 1];
+}
+
+// Return true if TwoCats accepts these parameters, and hashes memory with them.
+static bool validParameters(TwoCats_HashType hashType, uint8_t memCost, uint32_t lanes,
+        uint32_t multiplies, uint32_t parallelism, uint32_t blockSize, uint32_t subBlockSize) {
+    return lanes >= 1 && lanes <= TwoCats_GetHashTypeSize(hashType)/4 && multiplies <= 8 &&
+        parallelism >= 1 && parallelism <= 255 && subBlockSize >= 4*lanes &&
+        subBlockSize <= blockSize && ((uint64_t)1024 << memCost)/
+        ((uint64_t)parallelism*blockSize) >= 4;
+}
+
+/* --- Performance counters --- */
+
+// With -e, each thread counts these with perf_event_open around each slice it hashes,
+// using the library's event callback, and the counts are added up for each level of
+// garlic and slice.  Counters the kernel won't give us, as in most containers and VMs,
+// are reported as n/a.
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTER_PAGE_FAULTS,
+    NUM_COUNTERS
+} Counter;
+
+static char *counterNames[NUM_COUNTERS] = {"cycles", "instructions", "LLC-misses",
+    "dTLB-load-misses", "page-faults"};
+
+// What we print, computed from the counters.
+typedef enum {
+    METRIC_IPC,
+    METRIC_BYTES_PER_CYCLE,
+    METRIC_LLC_MISSES_PER_KIB,
+    METRIC_DTLB_MISSES_PER_KIB,
+    METRIC_PAGE_FAULTS_PER_KIB,
+    METRIC_READ_GBPS,
+    METRIC_WRITE_GBPS,
+    NUM_METRICS
+} Metric;
+
+static char *metricNames[NUM_METRICS] = {"IPC", "B/cycle", "LLC/KiB", "dTLB/KiB",
+    "faults/KiB", "rd GB/s", "wr GB/s"};
+static char *metricKeys[NUM_METRICS] = {"ipc", "bytesPerCycle", "llcMissesPerKiB",
+    "dtlbMissesPerKiB", "pageFaultsPerKiB", "readGBps", "writeGBps"};
+
+// TwoCats hashes each level of garlic in this many slices.
+#define NUM_SLICES 4
+#define NUM_LEVELS 31
+#define MAX_UNCORE_COUNTERS 64
+
+// Counts added up over every thread's slices, for every timed hash.
+typedef struct {
+    uint64_t counts[NUM_COUNTERS];
+    uint64_t bytes; // Memory written
+    bool resistant;
+} SliceTotals;
+
+typedef struct {
+    SliceTotals slices[NUM_SLICES];
+    uint64_t hashes;
+    uint64_t bytes;
+    uint64_t nanoseconds;
+    double readBytes, writeBytes; // Memory controller traffic
+} LevelTotals;
+
+// A memory controller counter, which counts traffic from the whole machine, so we read it
+// around each level, rather than each thread's slices.
+typedef struct {
+    int fd;
+    double bytesPerCount;
+    bool write;
+} UncoreCounter;
+
+// One line of the report, per hash.
+typedef struct {
+    double counts[NUM_COUNTERS];
+    bool haveCounts[NUM_COUNTERS];
+    double metrics[NUM_METRICS];
+    bool haveMetrics[NUM_METRICS];
+    bool resistant;
+} CounterRow;
+
+static bool counterAvailable[NUM_COUNTERS];
+static UncoreCounter uncoreCounters[MAX_UNCORE_COUNTERS];
+static uint32_t numUncoreCounters = 0;
+static LevelTotals levelTotals[NUM_LEVELS];
+static bool counting = false; // Not during warm-up hashes
+
+// Each thread opens its own counters the first time it hashes a slice.
+static __thread bool threadCountersOpen = false;
+static __thread int threadFds[NUM_COUNTERS];
+static __thread uint64_t sliceStart[NUM_COUNTERS];
+
+// Only the thread calling TwoCats reports levels.
+static uint64_t levelStart;
+static uint64_t uncoreStart[MAX_UNCORE_COUNTERS];
+
+static uint64_t getNanoseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*(uint64_t)1000000000 + t.tv_nsec;
+}
+
+static int perfEventOpen(struct perf_event_attr *attr, pid_t pid, int cpu) {
+    attr->size = sizeof(struct perf_event_attr);
+    attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, attr, pid, cpu, -1, 0);
+}
+
+// Open a counter for the calling thread.  Return -1 and set errno if we can't.
+static int openCounter(Counter counter) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    switch(counter) {
+    case COUNTER_CYCLES:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case COUNTER_INSTRUCTIONS:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case COUNTER_LLC_MISSES:
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case COUNTER_DTLB_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case COUNTER_PAGE_FAULTS:
+        // Faults are taken in the kernel, so don't exclude it
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+        attr.exclude_kernel = 0;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    return perfEventOpen(&attr, 0, -1);
+}
+
+// Read a counter, scaled up if the kernel had to share the hardware with other counters.
+static uint64_t readCounter(int fd) {
+    uint64_t values[3]; // Count, time enabled, time running
+    if(read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+        return 0;
+    }
+    if(values[2] < values[1]) {
+        return (uint64_t)((double)values[0]*values[1]/values[2]);
+    }
+    return values[0];
+}
+
+// Read a small sysfs file, without the trailing newline.
+static bool readSysfsFile(char *path, char *buf, uint32_t size) {
+    FILE *file = fopen(path, "r");
+    if(file == NULL) {
+        return false;
+    }
+    bool ok = fgets(buf, size, file) != NULL;
+    fclose(file);
+    buf[strcspn(buf, "\n")] = '\0';
+    return ok;
+}
+
+// Put value into the bits of config that the PMU's format file for this field gives, like
+// config:8-15.
+static bool setFormatField(char *pmuPath, char *field, uint64_t value, uint64_t *config) {
+    char path[512], format[64];
+    snprintf(path, sizeof(path), "%s/format/%s", pmuPath, field);
+    unsigned low, high;
+    if(!readSysfsFile(path, format, sizeof(format))) {
+        return false;
+    }
+    int fields = sscanf(format, "config:%u-%u", &low, &high);
+    if(fields < 1 || low > 63) {
+        return false; // Not in config, or a format we don't handle
+    }
+    *config |= value << low;
+    return true;
+}
+
+// Open a memory controller event, like cas_count_read, on each CPU in the PMU's cpumask.
+// Return false if the PMU does not have it, or we may not count it.
+static bool openUncoreEvent(char *pmuPath, char *event, bool write) {
+    char path[512], text[256];
+    snprintf(path, sizeof(path), "%s/type", pmuPath);
+    if(!readSysfsFile(path, text, sizeof(text))) {
+        return false;
+    }
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = strtoul(text, NULL, 0);
+    snprintf(path, sizeof(path), "%s/events/%s", pmuPath, event);
+    if(!readSysfsFile(path, text, sizeof(text))) {
+        return false;
+    }
+    uint64_t config = 0;
+    for(char *term = strtok(text, ","); term != NULL; term = strtok(NULL, ",")) {
+        char *equals = strchr(term, '=');
+        uint64_t value = 1;
+        if(equals != NULL) {
+            *equals = '\0';
+            value = strtoull(equals + 1, NULL, 0);
+        }
+        if(!setFormatField(pmuPath, term, value, &config)) {
+            return false;
+        }
+    }
+    attr.config = config;
+    // The scale and unit convert counts to bytes, for example 64 bytes per CAS
+    double bytesPerCount = 64.0;
+    snprintf(path, sizeof(path), "%s/events/%s.scale", pmuPath, event);
+    if(readSysfsFile(path, text, sizeof(text))) {
+        bytesPerCount = strtod(text, NULL);
+        snprintf(path, sizeof(path), "%s/events/%s.unit", pmuPath, event);
+        if(readSysfsFile(path, text, sizeof(text))) {
+            if(!strcmp(text, "MiB")) {
+                bytesPerCount *= 1024.0*1024.0;
+            } else if(!strcmp(text, "KiB")) {
+                bytesPerCount *= 1024.0;
+            }
+        }
+    }
+    snprintf(path, sizeof(path), "%s/cpumask", pmuPath);
+    if(!readSysfsFile(path, text, sizeof(text))) {
+        strcpy(text, "0");
+    }
+    bool opened = false;
+    for(char *cpu = strtok(text, ","); cpu != NULL; cpu = strtok(NULL, ",")) {
+        if(numUncoreCounters == MAX_UNCORE_COUNTERS) {
+            break;
+        }
+        int fd = perfEventOpen(&attr, -1, atoi(cpu));
+        if(fd >= 0) {
+            UncoreCounter *counter = uncoreCounters + numUncoreCounters++;
+            counter->fd = fd;
+            counter->bytesPerCount = bytesPerCount;
+            counter->write = write;
+            opened = true;
+        }
+    }
+    return opened;
+}
+
+// Open the memory controller counters.  Intel servers call their events cas_count_read
+// and cas_count_write, and desktops call them data_reads and data_writes.  Counting
+// them needs perf_event_paranoid <= 0, or CAP_PERFMON.
+static void openUncoreCounters(void) {
+    char *readEvents[] = {"cas_count_read", "data_reads", "data_read", NULL};
+    char *writeEvents[] = {"cas_count_write", "data_writes", "data_write", NULL};
+    char *devicesPath = "/sys/bus/event_source/devices";
+    DIR *dir = opendir(devicesPath);
+    if(dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "uncore_imc", 10)) {
+            continue;
+        }
+        char pmuPath[512];
+        snprintf(pmuPath, sizeof(pmuPath), "%s/%s", devicesPath, entry->d_name);
+        for(uint32_t i = 0; readEvents[i] != NULL; i++) {
+            if(openUncoreEvent(pmuPath, readEvents[i], false)) {
+                break;
+            }
+        }
+        for(uint32_t i = 0; writeEvents[i] != NULL; i++) {
+            if(openUncoreEvent(pmuPath, writeEvents[i], true)) {
+                break;
+            }
+        }
+    }
+    closedir(dir);
+}
+
+// Open this thread's counters.  If a counter that opened on the main thread fails here,
+// stop reporting it, since its totals would be missing this thread.
+static void openThreadCounters(void) {
+    for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+        threadFds[i] = -1;
+        if(__atomic_load_n(counterAvailable + i, __ATOMIC_RELAXED)) {
+            threadFds[i] = openCounter(i);
+            if(threadFds[i] < 0) {
+                __atomic_store_n(counterAvailable + i, false, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    threadCountersOpen = true;
+}
+
+// The event callback: read this thread's counters around each slice, and the memory
+// controller counters around each level.
+static void countEvent(const TwoCats_Event *event, void *userData) {
+    if(!counting || event->memCost >= NUM_LEVELS || event->slice >= NUM_SLICES) {
+        return;
+    }
+    LevelTotals *level = levelTotals + event->memCost;
+    switch(event->type) {
+    case TWOCATS_EVENT_SLICE_BEGIN:
+        if(!threadCountersOpen) {
+            openThreadCounters();
+        }
+        for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+            if(threadFds[i] >= 0) {
+                sliceStart[i] = readCounter(threadFds[i]);
+            }
+        }
+        break;
+    case TWOCATS_EVENT_SLICE_END: {
+        SliceTotals *slice = level->slices + event->slice;
+        for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+            if(threadFds[i] >= 0) {
+                __atomic_fetch_add(slice->counts + i, readCounter(threadFds[i]) - sliceStart[i],
+                    __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_fetch_add(&slice->bytes, event->bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&slice->resistant, event->resistant, __ATOMIC_RELAXED);
+        break;
+    }
+    case TWOCATS_EVENT_LEVEL_BEGIN:
+        for(uint32_t i = 0; i < numUncoreCounters; i++) {
+            uncoreStart[i] = readCounter(uncoreCounters[i].fd);
+        }
+        levelStart = getNanoseconds();
+        break;
+    case TWOCATS_EVENT_LEVEL_END:
+        level->nanoseconds += getNanoseconds() - levelStart;
+        for(uint32_t i = 0; i < numUncoreCounters; i++) {
+            double bytes = (readCounter(uncoreCounters[i].fd) - uncoreStart[i])*
+                uncoreCounters[i].bytesPerCount;
+            if(uncoreCounters[i].write) {
+                level->writeBytes += bytes;
+            } else {
+                level->readBytes += bytes;
+            }
+        }
+        level->hashes++;
+        level->bytes += event->bytes;
+        break;
+    default:;
+    }
+}
+
+// Open the counters we can on this thread, say which we can't, and start listening to
+// hashing events.
+static void startCounters(void) {
+    char unavailable[256] = "";
+    int error = 0;
+    for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+        threadFds[i] = openCounter(i);
+        counterAvailable[i] = threadFds[i] >= 0;
+        if(!counterAvailable[i]) {
+            error = errno;
+            snprintf(unavailable + strlen(unavailable), sizeof(unavailable) - strlen(unavailable),
+                "%s%s", *unavailable == '\0'? "" : ", ", counterNames[i]);
+        }
+    }
+    threadCountersOpen = true;
+    if(*unavailable != '\0') {
+        fprintf(stderr, "Counters unavailable: %s (%s)%s\n", unavailable, strerror(error),
+            error == EACCES || error == EPERM? ", see /proc/sys/kernel/perf_event_paranoid" : "");
+    }
+    openUncoreCounters();
+    if(numUncoreCounters == 0) {
+        fprintf(stderr, "Memory controller bandwidth unavailable\n");
+    }
+    TwoCats_SetEventCallback(countEvent, NULL);
+}
+
+// Set a metric if the counters it needs are available and the denominator is not 0.
+static void setMetric(CounterRow *row, Metric metric, bool available, double numerator,
+        double denominator) {
+    row->haveMetrics[metric] = available && denominator > 0.0;
+    row->metrics[metric] = row->haveMetrics[metric]? numerator/denominator : 0.0;
+}
+
+// Find the counts per hash for one slice of a level, or all of it if slice is NUM_SLICES.
+static void getCounterRow(uint32_t memCost, uint32_t slice, CounterRow *row) {
+    LevelTotals *level = levelTotals + memCost;
+    uint32_t firstSlice = slice == NUM_SLICES? 0 : slice;
+    uint32_t lastSlice = slice == NUM_SLICES? NUM_SLICES - 1 : slice;
+    double bytes = 0.0;
+    row->resistant = true;
+    for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+        row->counts[i] = 0.0;
+        row->haveCounts[i] = counterAvailable[i];
+    }
+    for(uint32_t s = firstSlice; s <= lastSlice; s++) {
+        for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+            row->counts[i] += (double)level->slices[s].counts[i]/level->hashes;
+        }
+        bytes += (double)level->slices[s].bytes/level->hashes;
+        row->resistant = row->resistant && level->slices[s].resistant;
+    }
+    double kib = bytes/1024.0;
+    double *counts = row->counts;
+    bool *have = row->haveCounts;
+    setMetric(row, METRIC_IPC, have[COUNTER_CYCLES] && have[COUNTER_INSTRUCTIONS],
+        counts[COUNTER_INSTRUCTIONS], counts[COUNTER_CYCLES]);
+    setMetric(row, METRIC_BYTES_PER_CYCLE, have[COUNTER_CYCLES], bytes, counts[COUNTER_CYCLES]);
+    setMetric(row, METRIC_LLC_MISSES_PER_KIB, have[COUNTER_LLC_MISSES],
+        counts[COUNTER_LLC_MISSES], kib);
+    setMetric(row, METRIC_DTLB_MISSES_PER_KIB, have[COUNTER_DTLB_MISSES],
+        counts[COUNTER_DTLB_MISSES], kib);
+    setMetric(row, METRIC_PAGE_FAULTS_PER_KIB, have[COUNTER_PAGE_FAULTS],
+        counts[COUNTER_PAGE_FAULTS], kib);
+    // Bandwidth is only measured for whole levels
+    bool haveBandwidth = slice == NUM_SLICES && numUncoreCounters != 0;
+    setMetric(row, METRIC_READ_GBPS, haveBandwidth, level->readBytes, level->nanoseconds);
+    setMetric(row, METRIC_WRITE_GBPS, haveBandwidth, level->writeBytes, level->nanoseconds);
+}
+
+// Print the counters for each level and slice hashed, below the line for its timings.
+static void printCountersText(void) {
+    printf("     %5s %5s %14s %14s", "level", "slice", "cycles", "instructions");
+    for(uint32_t i = 0; i < NUM_METRICS; i++) {
+        printf(" %10s", metricNames[i]);
+    }
+    printf("\n");
+    for(uint32_t memCost = 0; memCost < NUM_LEVELS; memCost++) {
+        if(levelTotals[memCost].hashes == 0) {
+            continue;
+        }
+        for(uint32_t slice = 0; slice <= NUM_SLICES; slice++) {
+            CounterRow row;
+            getCounterRow(memCost, slice, &row);
+            char sliceName[8];
+            if(slice == NUM_SLICES) {
+                strcpy(sliceName, "all");
+            } else {
+                snprintf(sliceName, sizeof(sliceName), "%u%s", slice, row.resistant? " r" : "");
+            }
+            printf("     %5u %5s", memCost, sliceName);
+            for(uint32_t i = COUNTER_CYCLES; i <= COUNTER_INSTRUCTIONS; i++) {
+                if(row.haveCounts[i]) {
+                    printf(" %14.0f", row.counts[i]);
+                } else {
+                    printf(" %14s", "n/a");
+                }
+            }
+            for(uint32_t i = 0; i < NUM_METRICS; i++) {
+                if(row.haveMetrics[i]) {
+                    printf(" %10.3f", row.metrics[i]);
+                } else {
+                    printf(" %10s", slice == NUM_SLICES || i < METRIC_READ_GBPS? "n/a" : "");
+                }
+            }
+            printf("\n");
+        }
+    }
+}
+
+// Print the counts and metrics for the whole level as CSV columns, empty if unavailable.
+static void printCountersCSV(uint8_t memCost) {
+    CounterRow row;
+    getCounterRow(memCost, NUM_SLICES, &row);
+    for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+        if(row.haveCounts[i]) {
+            printf(",%.0f", row.counts[i]);
+        } else {
+            printf(",");
+        }
+    }
+    for(uint32_t i = 0; i < NUM_METRICS; i++) {
+        if(row.haveMetrics[i]) {
+            printf(",%.4f", row.metrics[i]);
+        } else {
+            printf(",");
+        }
+    }
+}
+
+// Print a JSON array of the counters for each level and slice, with null if unavailable.
+static void printCountersJSON(void) {
+    bool first = true;
+    printf(", \"counters\": [");
+    for(uint32_t memCost = 0; memCost < NUM_LEVELS; memCost++) {
+        if(levelTotals[memCost].hashes == 0) {
+            continue;
+        }
+        for(uint32_t slice = 0; slice <= NUM_SLICES; slice++) {
+            CounterRow row;
+            getCounterRow(memCost, slice, &row);
+            printf("%s\n    {\"level\": %u, ", first? "" : ",", memCost);
+            if(slice == NUM_SLICES) {
+                printf("\"slice\": \"all\"");
+            } else {
+                printf("\"slice\": %u, \"resistant\": %s", slice, row.resistant? "true" : "false");
+            }
+            for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+                if(row.haveCounts[i]) {
+                    printf(", \"%s\": %.0f", counterNames[i], row.counts[i]);
+                } else {
+                    printf(", \"%s\": null", counterNames[i]);
+                }
+            }
+            for(uint32_t i = 0; i < NUM_METRICS; i++) {
+                if(row.haveMetrics[i]) {
+                    printf(", \"%s\": %.4f", metricKeys[i], row.metrics[i]);
+                } else if(slice == NUM_SLICES || i < METRIC_READ_GBPS) {
+                    printf(", \"%s\": null", metricKeys[i]);
+                }
+            }
+            printf("}");
+            first = false;
+        }
+    }
+    printf("]");
+}
+
+static void printHeader(Format format, bool countersEnabled) {
+    switch(format) {
+    case FORMAT_TEXT:
+        printf("%-4s %-8s %-7s %2s %2s %2s %3s %8s %5s %10s %10s %10s %8s %9s\n", "lib",
+            "hash", "impl", "m", "M", "l", "P", "block", "sub", "p50 ms", "p99 ms",
+            "mean ms", "GB/s", "hashes/s");
+        break;
+    case FORMAT_CSV:
+        printf("library,hash,implementation,memCost,multiplies,lanes,parallelism,blockSize,"
+            "subBlockSize,resistant,samples,minMs,p50Ms,p99Ms,meanMs,GBps,hashesPerSec");
+        if(countersEnabled) {
+            for(uint32_t i = 0; i < NUM_COUNTERS; i++) {
+                printf(",%s", counterNames[i]);
+            }
+            for(uint32_t i = 0; i < NUM_METRICS; i++) {
+                printf(",%s", metricKeys[i]);
+            }
+        }
+        printf("\n");
+        break;
+    case FORMAT_JSON:
+        printf("[");
+        break;
+    }
+}
+
+int main(int argc, char **argv) {
+    ValueList memCosts, multiplies, lanes, parallelisms, blockSizes, subBlockSizes;
+    setValueList(&memCosts, 18);
+    setValueList(&multiplies, TWOCATS_MULTIPLIES);
+    setValueList(&lanes, TWOCATS_LANES);
+    setValueList(&parallelisms, TWOCATS_PARALLELISM);
+    setValueList(&blockSizes, TWOCATS_BLOCKSIZE);
+    setValueList(&subBlockSizes, TWOCATS_SUBBLOCKSIZE);
+    uint32_t numSamples = 10;
+    uint32_t numWarmups = 1;
+    bool sideChannelResistant = false;
+    TwoCats_PageMode pageMode = TWOCATS_PAGES_DEFAULT;
+    Format format = FORMAT_TEXT;
+    bool countersEnabled = false;
+
+    int c;
+    while((c = getopt(argc, argv, "m:M:l:P:b:B:n:w:rI:H:f:e")) != -1) {
+        switch (c) {
+        case 'm':
+            readValueList(c, optarg, &memCosts);
+            break;
+        case 'M':
+            readValueList(c, optarg, &multiplies);
+            break;
+        case 'l':
+            readValueList(c, optarg, &lanes);
+            break;
+        case 'P':
+            readValueList(c, optarg, &parallelisms);
+            break;
+        case 'b':
+            readValueList(c, optarg, &blockSizes);
+            break;
+        case 'B':
+            readValueList(c, optarg, &subBlockSizes);
+            break;
+        case 'n':
+            numSamples = readuint32_t(c, optarg);
+            if(numSamples == 0 || numSamples > MAX_SAMPLES) {
+                usage("samples must be from 1 to %u\n", MAX_SAMPLES);
+            }
+            break;
+        case 'w':
+            numWarmups = readuint32_t(c, optarg);
+            break;
+        case 'r':
+            sideChannelResistant = true;
+            break;
+        case 'I': {
+            TwoCats_Implementation impl = TwoCats_FindImplementation(optarg);
+            if(impl == TWOCATS_IMPL_NONE || !TwoCats_SetImplementation(impl)) {
+                usage("Unsupported implementation: %s\n", optarg);
+            }
+            break;
+        }
+        case 'H':
+            pageMode = TwoCats_FindPageMode(optarg);
+            if(pageMode == TWOCATS_PAGES_NONE) {
+                usage("Unsupported page mode: %s\n", optarg);
+            }
+            break;
+        case 'f':
+            if(!strcmp(optarg, "text")) {
+                format = FORMAT_TEXT;
+            } else if(!strcmp(optarg, "csv")) {
+                format = FORMAT_CSV;
+            } else if(!strcmp(optarg, "json")) {
+                format = FORMAT_JSON;
+            } else {
+                usage("Unsupported format: %s\n", optarg);
+            }
+            break;
+        case 'e':
+            countersEnabled = true;
+            break;
+        default:
+            usage("Invalid argument");
+        }
+    }
+    TwoCats_HashType hashTypes[TWOCATS_NONE];
+    uint32_t numHashTypes = 0;
+    if(optind == argc) {
+        hashTypes[numHashTypes++] = TWOCATS_BLAKE2S;
+    }
+    for(int i = optind; i < argc; i++) {
+        if(numHashTypes == TWOCATS_NONE) {
+            usage("Too many hash types\n");
+        }
+        hashTypes[numHashTypes] = TwoCats_FindHashType(argv[i]);
+        if(hashTypes[numHashTypes] == TWOCATS_NONE) {
+            usage("Unsupported hash type: %s\n", argv[i]);
+        }
+        numHashTypes++;
+    }
+
+    // Hash in one buffer big enough for the largest memCost, so we time hashing, not
+    // allocating and faulting in memory
+    uint8_t maxMemCost = 0;
+    for(uint32_t i = 0; i < memCosts.numValues; i++) {
+        if(memCosts.values[i] > 30) {
+            usage("memCost must be <= 30\n");
+        }
+        if(memCosts.values[i] > maxMemCost) {
+            maxMemCost = memCosts.values[i];
+        }
+    }
+    void *memory = TwoCats_AllocateMemory(maxMemCost, pageMode, &pageMode);
+    if(memory == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    char *implName = TwoCats_GetImplementationName(TwoCats_GetImplementation());
+    double *times = malloc(numSamples*sizeof(double));
+    bool first = true;
+    if(countersEnabled) {
+        startCounters();
+    }
+    printHeader(format, countersEnabled);
+
+    for(uint32_t h = 0; h < numHashTypes; h++)
+    for(uint32_t m = 0; m < memCosts.numValues; m++)
+    for(uint32_t M = 0; M < multiplies.numValues; M++)
+    for(uint32_t l = 0; l < lanes.numValues; l++)
+    for(uint32_t P = 0; P < parallelisms.numValues; P++)
+    for(uint32_t b = 0; b < blockSizes.numValues; b++)
+    for(uint32_t B = 0; B < subBlockSizes.numValues; B++) {
+        TwoCats_HashType hashType = hashTypes[h];
+        uint8_t memCost = memCosts.values[m];
+        if(!validParameters(hashType, memCost, lanes.values[l], multiplies.values[M],
+                parallelisms.values[P], blockSizes.values[b], subBlockSizes.values[B])) {
+            continue;
+        }
+        uint8_t hash[TwoCats_GetHashTypeSize(hashType)];
+        memset(levelTotals, 0, sizeof(levelTotals));
+        for(uint32_t i = 0; i < numWarmups + numSamples; i++) {
+            counting = countersEnabled && i >= numWarmups;
+            double start = getMilliseconds();
+            if(!TwoCats_HashPasswordExtended(memory, hashType, hash, NULL, 0, NULL, 0, NULL, 0,
+                    memCost, memCost, multiplies.values[M], lanes.values[l],
+                    parallelisms.values[P], blockSizes.values[b], subBlockSizes.values[B], 0,
+                    false, sideChannelResistant)) {
+                fprintf(stderr, "Memory hashing failed\n");
+                return 1;
+            }
+            if(i >= numWarmups) {
+                times[i - numWarmups] = getMilliseconds() - start;
+            }
+        }
+        double total = 0.0;
+        for(uint32_t i = 0; i < numSamples; i++) {
+            total += times[i];
+        }
+        qsort(times, numSamples, sizeof(double), compareDoubles);
+        double mean = total/numSamples;
+        double p50 = percentile(times, numSamples, 0.5);
+        double p99 = percentile(times, numSamples, 0.99);
+        // Hashing each block reads the previous block and the from block, and writes one
+        double gbps = 3.0*((uint64_t)1024 << memCost)/(p50*1e6);
+        double hashesPerSec = 1000.0/mean;
+        char *hashName = TwoCats_GetHashTypeName(hashType);
+        switch(format) {
+        case FORMAT_TEXT:
+            printf("%-4s %-8s %-7s %2u %2u %2u %3u %8u %5u %10.2f %10.2f %10.2f %8.2f %9.2f\n",
+                BENCH_LIBRARY, hashName, implName, memCost, multiplies.values[M],
+                lanes.values[l], parallelisms.values[P], blockSizes.values[b],
+                subBlockSizes.values[B], p50, p99, mean, gbps, hashesPerSec);
+            if(countersEnabled) {
+                printCountersText();
+            }
+            break;
+        case FORMAT_CSV:
+            printf("%s,%s,%s,%u,%u,%u,%u,%u,%u,%d,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f",
+                BENCH_LIBRARY, hashName, implName, memCost, multiplies.values[M],
+                lanes.values[l], parallelisms.values[P], blockSizes.values[b],
+                subBlockSizes.values[B], sideChannelResistant, numSamples, times[0], p50,
+                p99, mean, gbps, hashesPerSec);
+            if(countersEnabled) {
+                printCountersCSV(memCost);
+            }
+            printf("\n");
+            break;
+        case FORMAT_JSON:
+            printf("%s\n  {\"library\": \"%s\", \"hash\": \"%s\", \"implementation\": \"%s\", "
+                "\"memCost\": %u, \"multiplies\": %u, \"lanes\": %u, \"parallelism\": %u, "
+                "\"blockSize\": %u, \"subBlockSize\": %u, \"resistant\": %s, "
+                "\"samples\": %u, \"minMs\": %.3f, \"p50Ms\": %.3f, \"p99Ms\": %.3f, "
+                "\"meanMs\": %.3f, \"GBps\": %.3f, \"hashesPerSec\": %.3f",
+                first? "" : ",", BENCH_LIBRARY, hashName, implName, memCost,
+                multiplies.values[M], lanes.values[l], parallelisms.values[P],
+                blockSizes.values[b], subBlockSizes.values[B],
+                sideChannelResistant? "true" : "false", numSamples, times[0], p50, p99, mean,
+                gbps, hashesPerSec);
+            if(countersEnabled) {
+                printCountersJSON();
+            }
+            printf("}");
+            break;
+        }
+        fflush(stdout);
+        first = false;
+    }
+    if(format == FORMAT_JSON) {
+        printf("\n]\n");
+    }
+    free(times);
+    TwoCats_FreeMemory(memory, maxMemCost, pageMode);
+    return 0;
+}
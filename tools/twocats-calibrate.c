@@ -0,0 +1,221 @@
+/*
+   TwoCats calibration tool, which writes a tuning profile for this machine.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "twocats.h"
+
+// How many times the sweep times each setting.
+#define SWEEP_SAMPLES 3
+
+static void usage(char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, (char *)format, ap);
+    va_end(ap);
+    fprintf(stderr, "\nUsage: twocats-calibrate [OPTIONS] [hashType...]\n"
+        "    -o profile       -- Write the tuning profile here, defaults to twocats.profile\n"
+        "    -t milliseconds  -- Target runtime, defaults to 1000\n"
+        "    -m memCost       -- Use at most 2^memCost KiB of memory, defaults to 20\n"
+        "    -P parallelism   -- Use at most this many threads, defaults to the CPU count\n"
+        "    -s               -- Sweep blockSize and subBlockSize at 2^memCost KiB, and\n"
+        "                        compare them to what TwoCats_FindBlockSizes picks\n"
+        "Calibrates every hash type unless some are listed.  Set TWOCATS_PROFILE to the\n"
+        "profile to use it.  The settings become part of every hash computed with it.\n");
+    exit(1);
+}
+
+static uint32_t readuint32_t(char flag, char *arg) {
+    char *endPtr;
+    char *p = arg;
+    uint32_t value = strtol(p, &endPtr, 0);
+    if(*p == '\0' || *endPtr != '\0') {
+        usage("Invalid integer for parameter -%c", flag);
+    }
+    return value;
+}
+
+// Return the wall-clock time in milliseconds.
+static double getMilliseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000.0 + t.tv_nsec/1000000.0;
+}
+
+// Return the median time of hashing with the parameters, or -1 if hashing fails.
+static double timeHash(TwoCats_Parameters *params) {
+    uint8_t hash[TwoCats_GetHashTypeSize(params->hashType)];
+    double times[SWEEP_SAMPLES];
+    for(uint32_t i = 0; i < SWEEP_SAMPLES; i++) {
+        double start = getMilliseconds();
+        if(!TwoCats_HashPasswordExtended(NULL, params->hashType, hash, NULL, 0, NULL, 0,
+                NULL, 0, params->memCost, params->memCost, params->multiplies, params->lanes,
+                params->parallelism, params->blockSize, params->subBlockSize, 0, false,
+                false)) {
+            return -1.0;
+        }
+        double time = getMilliseconds() - start;
+        uint32_t j = i;
+        while(j > 0 && times[j - 1] > time) {
+            times[j] = times[j - 1];
+            j--;
+        }
+        times[j] = time;
+    }
+    return times[SWEEP_SAMPLES/2];
+}
+
+// Time every blockSize and subBlockSize, and show how the ones TwoCats_FindBlockSizes
+// picks compare to the fastest.
+static void sweep(TwoCats_HashType hashType, uint8_t memCost, uint8_t parallelism) {
+    TwoCats_CacheInfo info;
+    TwoCats_GetCacheInfo(&info);
+    printf("L1d:%lluK L2:%lluK LLC:%lluK line:%u cpusPerL2:%u\n",
+        (unsigned long long)info.l1DataSize >> 10, (unsigned long long)info.l2Size >> 10,
+        (unsigned long long)info.lastLevelSize >> 10, info.lineSize, info.cpusPerL2);
+    TwoCats_Parameters params = {hashType, memCost, TWOCATS_MULTIPLIES, TWOCATS_LANES,
+        parallelism, 0, 0, 0.0, 0.0};
+    if(params.lanes > TwoCats_GetHashTypeSize(hashType)/4) {
+        params.lanes = TwoCats_GetHashTypeSize(hashType)/4;
+    }
+    uint32_t pickedBlockSize, pickedSubBlockSize;
+    TwoCats_FindBlockSizes(params.lanes, parallelism, &pickedBlockSize, &pickedSubBlockSize);
+    double pickedTime = -1.0, bestTime = -1.0;
+    uint32_t bestBlockSize = 0, bestSubBlockSize = 0;
+    printf("blockSize subBlockSize milliseconds\n");
+    for(params.blockSize = 4096; params.blockSize <= (1 << 20); params.blockSize <<= 1) {
+        if(((uint64_t)1024 << memCost)/((uint64_t)parallelism*params.blockSize) < 256) {
+            break; // Too few blocks per thread
+        }
+        for(params.subBlockSize = 32; params.subBlockSize <= 1024; params.subBlockSize <<= 1) {
+            if(params.subBlockSize < 4*params.lanes) {
+                continue;
+            }
+            double time = timeHash(&params);
+            if(time < 0.0) {
+                fprintf(stderr, "Memory hashing failed\n");
+                exit(1);
+            }
+            bool picked = params.blockSize == pickedBlockSize &&
+                params.subBlockSize == pickedSubBlockSize;
+            printf("%9u %12u %12.1f%s\n", params.blockSize, params.subBlockSize, time,
+                picked? " *" : "");
+            if(picked) {
+                pickedTime = time;
+            }
+            if(bestTime < 0.0 || time < bestTime) {
+                bestTime = time;
+                bestBlockSize = params.blockSize;
+                bestSubBlockSize = params.subBlockSize;
+            }
+        }
+    }
+    printf("fastest: blockSize:%u subBlockSize:%u %.1fms\n", bestBlockSize, bestSubBlockSize,
+        bestTime);
+    if(pickedTime >= 0.0) {
+        printf("picked:  blockSize:%u subBlockSize:%u %.1fms (%+.1f%%)\n", pickedBlockSize,
+            pickedSubBlockSize, pickedTime, 100.0*(pickedTime - bestTime)/bestTime);
+    } else {
+        printf("picked:  blockSize:%u subBlockSize:%u, not in the sweep\n", pickedBlockSize,
+            pickedSubBlockSize);
+    }
+}
+
+// Calibrate one hash type, and add it to the profile.
+static void calibrate(TwoCats_HashType hashType, uint32_t milliseconds, uint8_t memCost,
+        uint8_t parallelism) {
+    TwoCats_Parameters params;
+    if(!TwoCats_CalibrateParameters(hashType, milliseconds, 1 << memCost, parallelism,
+            &params)) {
+        fprintf(stderr, "Calibration failed\n");
+        exit(1);
+    }
+    printf("%s: lanes:%u multiplies:%u blockSize:%u subBlockSize:%u\n",
+        TwoCats_GetHashTypeName(hashType), params.lanes, params.multiplies, params.blockSize,
+        params.subBlockSize);
+    printf("    memCost:%u parallelism:%u runtime:%.1fms +/- %.1fms\n", params.memCost,
+        params.parallelism, params.runtime, sqrt(params.runtimeVariance));
+    if(!TwoCats_SetProfileParameters(&params)) {
+        fprintf(stderr, "Calibration found invalid settings\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    char *path = "twocats.profile";
+    uint32_t milliseconds = 1000;
+    uint8_t memCost = TWOCATS_MEMCOST;
+    uint8_t parallelism = 0;
+    bool sweepMode = false;
+
+    int c;
+    while((c = getopt(argc, argv, "o:t:m:P:s")) != -1) {
+        switch (c) {
+        case 'o':
+            path = optarg;
+            break;
+        case 't':
+            milliseconds = readuint32_t(c, optarg);
+            break;
+        case 'm':
+            memCost = readuint32_t(c, optarg);
+            if(memCost > 30) {
+                usage("memCost must be <= 30\n");
+            }
+            break;
+        case 'P':
+            parallelism = readuint32_t(c, optarg);
+            break;
+        case 's':
+            sweepMode = true;
+            break;
+        default:
+            usage("Invalid argument");
+        }
+    }
+    if(sweepMode) {
+        TwoCats_HashType hashType = TWOCATS_HASHTYPE;
+        if(optind + 1 == argc) {
+            hashType = TwoCats_FindHashType(argv[optind]);
+            if(hashType == TWOCATS_NONE) {
+                usage("Unsupported hash type: %s\n", argv[optind]);
+            }
+        } else if(optind != argc) {
+            usage("Sweep one hash type at a time\n");
+        }
+        sweep(hashType, memCost, parallelism == 0? 1 : parallelism);
+        return 0;
+    }
+    if(optind == argc) {
+        for(uint32_t hashType = 0; hashType < TWOCATS_NONE; hashType++) {
+            calibrate(hashType, milliseconds, memCost, parallelism);
+        }
+    }
+    for(int i = optind; i < argc; i++) {
+        TwoCats_HashType hashType = TwoCats_FindHashType(argv[i]);
+        if(hashType == TWOCATS_NONE) {
+            usage("Unsupported hash type: %s\n", argv[i]);
+        }
+        calibrate(hashType, milliseconds, memCost, parallelism);
+    }
+    if(!TwoCats_SaveProfile(path)) {
+        return 1;
+    }
+    printf("Wrote %s\n", path);
+    return 0;
+}
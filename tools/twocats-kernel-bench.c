@@ -0,0 +1,369 @@
+/*
+   TwoCats kernel microbenchmark, which times the memory hashing kernel, H->HashState, and
+   H->ExpandUint32 on their own.
+
+   Written in 2014 by Bill Cox <waywardgeek@gmail.com>
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "twocats-internal.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+// Each measurement runs this many batches, each long enough to take BATCH_MS, after one
+// untimed warm-up batch.  The slowest quarter of batches are dropped as outliers, since
+// interrupts and other processes only ever make a batch slower.
+#define NUM_BATCHES 12
+#define BATCH_MS 2.0
+
+#define MAX_VALUES 16
+
+// A comma separated list of values to run, like 1,2,4.
+typedef struct {
+    uint32_t values[MAX_VALUES];
+    uint32_t numValues;
+} ValueList;
+
+// What the primitive being timed needs.
+typedef struct {
+    TwoCats_H H;
+    TwoCats_HashBlocksFunc hashBlocks;
+    uint32_t *mem;
+    uint32_t *state;
+    uint32_t *out;
+    uint64_t numBlocks; // In the working set
+    uint64_t toBlock;
+    uint32_t blocklen;
+    uint32_t subBlocklen;
+    uint32_t random;
+    uint8_t multiplies;
+    uint8_t lanes;
+} Bench;
+
+typedef void (*BenchFunc)(Bench *b, uint32_t calls);
+
+// The kernels for each implementation, indexed by TwoCats_Implementation.
+static const TwoCats_FindHashBlocksFunc findHashBlocksFuncs[TWOCATS_IMPL_NONE] = {
+    TwoCats_FindHashBlocksGeneric,
+    TwoCats_FindHashBlocksSSE2,
+    TwoCats_FindHashBlocksSSSE3,
+    TwoCats_FindHashBlocksSSE41,
+    TwoCats_FindHashBlocksAVX2,
+    TwoCats_FindHashBlocksAVX512
+};
+
+static void usage(char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, (char *)format, ap);
+    va_end(ap);
+    fprintf(stderr, "\nUsage: twocats-kernel-bench [OPTIONS] [hashType...]\n"
+        "    -k kernels       -- Which to time: blocks, state, expand, or all (default)\n"
+        "    -l lanes         -- Comma separated lanes for the kernel, default 1,2,4,8,16\n"
+        "    -M multiplies    -- Comma separated multiplies, default 0 through 8\n"
+        "    -B subBlockSizes -- Comma separated sub-block sizes, default 32 through 1024\n"
+        "    -b blockSize     -- Block size, defaults to %u\n"
+        "    -w workingSet    -- cache, dram, or both (default cache).  Cache fits the\n"
+        "                        blocks in half the L2 cache, and dram is 4X the LLC.\n"
+        "    -I implementation -- Time this implementation, or all, rather than the fastest\n"
+        "Times every hash type unless some are listed.  Cycles are time stamp counter\n"
+        "ticks, which run at the CPU's base frequency.\n", TWOCATS_BLOCKSIZE);
+    exit(1);
+}
+
+static uint32_t readuint32_t(char flag, char *arg) {
+    char *endPtr;
+    char *p = arg;
+    uint32_t value = strtol(p, &endPtr, 0);
+    if(*p == '\0' || *endPtr != '\0') {
+        usage("Invalid integer for parameter -%c", flag);
+    }
+    return value;
+}
+
+// Read a comma separated list of integers.
+static void readValueList(char flag, char *arg, ValueList *list) {
+    list->numValues = 0;
+    char *p = arg;
+    while(true) {
+        char *endPtr;
+        uint32_t value = strtoul(p, &endPtr, 0);
+        if(endPtr == p || (*endPtr != ',' && *endPtr != '\0')) {
+            usage("Invalid list of integers for parameter -%c", flag);
+        }
+        if(list->numValues == MAX_VALUES) {
+            usage("Too many values for parameter -%c", flag);
+        }
+        list->values[list->numValues++] = value;
+        if(*endPtr == '\0') {
+            return;
+        }
+        p = endPtr + 1;
+    }
+}
+
+// Return the wall-clock time in milliseconds.
+static double getMilliseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000.0 + t.tv_nsec/1000000.0;
+}
+
+static uint64_t getCycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y? -1 : x > y;
+}
+
+// Hash the next block of the working set, from a random earlier block, like hashing a
+// slice with password dependent addressing.
+static void benchHashBlocks(Bench *b, uint32_t calls) {
+    for(uint32_t i = 0; i < calls; i++) {
+        if(++b->toBlock == b->numBlocks) {
+            b->toBlock = 1;
+        }
+        b->random = b->random*1664525 + 1013904223;
+        uint64_t fromBlock = ((uint64_t)b->random*b->toBlock) >> 32;
+        uint64_t toAddr = b->toBlock*b->blocklen;
+        b->random ^= b->hashBlocks(b->state, b->mem, b->blocklen, b->subBlocklen,
+            fromBlock*b->blocklen, toAddr - b->blocklen, toAddr, b->multiplies, b->lanes);
+    }
+}
+
+static void benchHashState(Bench *b, uint32_t calls) {
+    for(uint32_t i = 0; i < calls; i++) {
+        b->H.HashState(&b->H, b->state, i);
+    }
+}
+
+static void benchExpand(Bench *b, uint32_t calls) {
+    for(uint32_t i = 0; i < calls; i++) {
+        b->H.ExpandUint32(&b->H, b->out, b->blocklen, b->state);
+    }
+}
+
+// Time the function, and print how long a call takes, and how many cycles a byte takes.
+static void measure(Bench *b, BenchFunc func, uint64_t bytesPerCall, const char *description) {
+    // Find how many calls take BATCH_MS, which is also the warm-up
+    uint32_t calls = 1;
+    while(true) {
+        double start = getMilliseconds();
+        func(b, calls);
+        double time = getMilliseconds() - start;
+        if(time >= BATCH_MS || calls >= (1 << 30)) {
+            break;
+        }
+        calls = time < BATCH_MS/16? calls*16 : calls*2;
+    }
+    double nsPerCall[NUM_BATCHES];
+    double cyclesPerCall[NUM_BATCHES];
+    for(uint32_t i = 0; i < NUM_BATCHES; i++) {
+        double start = getMilliseconds();
+        uint64_t startCycles = getCycles();
+        func(b, calls);
+        cyclesPerCall[i] = (double)(getCycles() - startCycles)/calls;
+        nsPerCall[i] = (getMilliseconds() - start)*1e6/calls;
+    }
+    qsort(nsPerCall, NUM_BATCHES, sizeof(double), compareDoubles);
+    qsort(cyclesPerCall, NUM_BATCHES, sizeof(double), compareDoubles);
+    double ns = 0.0, cycles = 0.0;
+    uint32_t kept = NUM_BATCHES - NUM_BATCHES/4;
+    for(uint32_t i = 0; i < kept; i++) {
+        ns += nsPerCall[i];
+        cycles += cyclesPerCall[i];
+    }
+    ns /= kept;
+    cycles /= kept;
+    printf("%-48s %12.1f %12.0f %10.3f %8.2f\n", description, ns, 1e9/ns,
+        cycles/bytesPerCall, bytesPerCall/ns);
+}
+
+// Time the kernel for each lanes, multiplies, and subBlockSize.
+static void benchKernels(Bench *b, uint8_t *buf, uint64_t workingSet, const char *setName,
+        uint32_t blockSize, ValueList *lanes, ValueList *multiplies, ValueList *subBlockSizes) {
+    TwoCats_Implementation impl = TwoCats_GetImplementation();
+    b->mem = (uint32_t *)buf;
+    b->blocklen = blockSize/sizeof(uint32_t);
+    b->numBlocks = workingSet/blockSize;
+    b->toBlock = 0;
+    for(uint32_t l = 0; l < lanes->numValues; l++)
+    for(uint32_t M = 0; M < multiplies->numValues; M++)
+    for(uint32_t B = 0; B < subBlockSizes->numValues; B++) {
+        b->lanes = lanes->values[l];
+        b->multiplies = multiplies->values[M];
+        uint32_t subBlockSize = subBlockSizes->values[B];
+        b->subBlocklen = subBlockSize/sizeof(uint32_t);
+        if(b->lanes == 0 || b->lanes > 16 || b->multiplies > 8 || subBlockSize < 4*b->lanes ||
+                subBlockSize > blockSize) {
+            continue;
+        }
+        b->hashBlocks = findHashBlocksFuncs[impl](b->subBlocklen, b->multiplies, b->lanes);
+        char description[80];
+        snprintf(description, sizeof(description), "blocks %s %s l%u M%u B%u",
+            TwoCats_GetImplementationName(impl), setName, b->lanes, b->multiplies,
+            subBlockSize);
+        // Each call reads the previous and from blocks, and writes one
+        measure(b, benchHashBlocks, 3*(uint64_t)blockSize, description);
+    }
+}
+
+int main(int argc, char **argv) {
+    ValueList lanes = {{1, 2, 4, 8, 16}, 5};
+    ValueList multiplies = {{0, 1, 2, 3, 4, 5, 6, 7, 8}, 9};
+    ValueList subBlockSizes = {{32, 64, 128, 256, 512, 1024}, 6};
+    uint32_t blockSize = TWOCATS_BLOCKSIZE;
+    bool doBlocks = true, doState = true, doExpand = true;
+    bool doCache = true, doDram = false;
+    bool allImpls = false;
+
+    int c;
+    while((c = getopt(argc, argv, "k:l:M:B:b:w:I:")) != -1) {
+        switch (c) {
+        case 'k':
+            doBlocks = !strcmp(optarg, "blocks") || !strcmp(optarg, "all");
+            doState = !strcmp(optarg, "state") || !strcmp(optarg, "all");
+            doExpand = !strcmp(optarg, "expand") || !strcmp(optarg, "all");
+            if(!doBlocks && !doState && !doExpand) {
+                usage("Unknown kernel: %s\n", optarg);
+            }
+            break;
+        case 'l':
+            readValueList(c, optarg, &lanes);
+            break;
+        case 'M':
+            readValueList(c, optarg, &multiplies);
+            break;
+        case 'B':
+            readValueList(c, optarg, &subBlockSizes);
+            break;
+        case 'b':
+            blockSize = readuint32_t(c, optarg);
+            if(blockSize < 32 || blockSize > (1 << 20) || (blockSize & (blockSize - 1))) {
+                usage("blockSize must be a power of 2 from 32 to 2^20\n");
+            }
+            break;
+        case 'w':
+            doCache = !strcmp(optarg, "cache") || !strcmp(optarg, "both");
+            doDram = !strcmp(optarg, "dram") || !strcmp(optarg, "both");
+            if(!doCache && !doDram) {
+                usage("Unknown working set: %s\n", optarg);
+            }
+            break;
+        case 'I':
+            if(!strcmp(optarg, "all")) {
+                allImpls = true;
+            } else {
+                TwoCats_Implementation impl = TwoCats_FindImplementation(optarg);
+                if(impl == TWOCATS_IMPL_NONE || !TwoCats_SetImplementation(impl)) {
+                    usage("Unsupported implementation: %s\n", optarg);
+                }
+            }
+            break;
+        default:
+            usage("Invalid argument");
+        }
+    }
+    bool hashTypes[TWOCATS_NONE] = {optind == argc, optind == argc, optind == argc,
+        optind == argc};
+    for(int i = optind; i < argc; i++) {
+        TwoCats_HashType hashType = TwoCats_FindHashType(argv[i]);
+        if(hashType == TWOCATS_NONE) {
+            usage("Unsupported hash type: %s\n", argv[i]);
+        }
+        hashTypes[hashType] = true;
+    }
+
+    // The cache working set fits the blocks in half of L2, like TwoCats_FindBlockSizes
+    // expects, and the DRAM one is well past the last level cache
+    TwoCats_CacheInfo info;
+    TwoCats_GetCacheInfo(&info);
+    uint64_t l2Size = info.l2Size != 0? info.l2Size : 256*1024;
+    uint64_t cacheSet = l2Size/2 < 4*(uint64_t)blockSize? 4*(uint64_t)blockSize : l2Size/2;
+    uint64_t dramSet = 4*info.lastLevelSize;
+    if(dramSet < ((uint64_t)256 << 20)) {
+        dramSet = (uint64_t)256 << 20;
+    }
+    uint64_t bufSize = doDram? dramSet : cacheSet;
+    uint8_t *buf;
+    uint32_t *out;
+    if(posix_memalign((void *)&buf, 64, bufSize) ||
+            posix_memalign((void *)&out, 64, blockSize)) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    // Fault it in, and give the kernel something other than zeros to hash
+    for(uint64_t i = 0; i < bufSize; i++) {
+        buf[i] = i*0x9e3779b9 >> 24;
+    }
+    uint32_t state[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+
+    printf("%-48s %12s %12s %10s %8s\n", "kernel", "ns/call", "calls/s", "cycles/B", "GB/s");
+    TwoCats_Implementation defaultImpl = TwoCats_GetImplementation();
+    for(TwoCats_Implementation impl = 0; impl < TWOCATS_IMPL_NONE; impl++) {
+        if(allImpls? !TwoCats_SetImplementation(impl) : impl != defaultImpl) {
+            continue;
+        }
+        Bench b;
+        memset(&b, 0, sizeof(Bench));
+        b.state = state;
+        b.out = out;
+        b.random = 1;
+        if(doBlocks) {
+            if(doCache) {
+                benchKernels(&b, buf, cacheSet, "cache", blockSize, &lanes, &multiplies,
+                    &subBlockSizes);
+            }
+            if(doDram) {
+                benchKernels(&b, buf, dramSet, "dram", blockSize, &lanes, &multiplies,
+                    &subBlockSizes);
+            }
+        }
+        for(TwoCats_HashType hashType = 0; hashType < TWOCATS_NONE; hashType++) {
+            if(!hashTypes[hashType]) {
+                continue;
+            }
+            TwoCats_InitHash(&b.H, hashType);
+            char description[80];
+            if(doState) {
+                // The state is hashed as one block of the hash function
+                snprintf(description, sizeof(description), "state %s %s",
+                    TwoCats_GetImplementationName(impl), TwoCats_GetHashTypeName(hashType));
+                measure(&b, benchHashState, b.H.size, description);
+            }
+            if(doExpand) {
+                b.blocklen = blockSize/sizeof(uint32_t);
+                snprintf(description, sizeof(description), "expand %s %s b%u",
+                    TwoCats_GetImplementationName(impl), TwoCats_GetHashTypeName(hashType),
+                    blockSize);
+                measure(&b, benchExpand, blockSize, description);
+            }
+        }
+    }
+    TwoCats_SetImplementation(defaultImpl);
+    free(buf);
+    free(out);
+    return 0;
+}